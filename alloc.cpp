@@ -0,0 +1,167 @@
+#include "alloc.h"
+
+#define FREE_BIT(b) ((uint64_t)1 << ((b) % 64))
+
+BlockAllocator::BlockAllocator()
+{
+    first_block = 0;
+    no_blocks = 0;
+    free_count = 0;
+    cursor = 0;
+}
+
+// marks all <no_blocks> blocks as free, blocks below <first_block> are
+// never handed out
+void
+BlockAllocator::reset(unsigned first_block, unsigned no_blocks)
+{
+    this->first_block = first_block;
+    this->no_blocks = no_blocks;
+    bitmap.assign((no_blocks + 63) / 64, ~(uint64_t)0);
+    // clear the bits below first_block and past the last block
+    for (unsigned i = 0; i < first_block && i < no_blocks; i++)
+        bitmap[i / 64] &= ~FREE_BIT(i);
+    if (no_blocks % 64)
+        bitmap.back() &= FREE_BIT(no_blocks) - 1;
+    free_count = no_blocks > first_block ? no_blocks - first_block : 0;
+    cursor = first_block;
+}
+
+bool
+BlockAllocator::is_free(unsigned block_no)
+{
+    return (bitmap[block_no / 64] & FREE_BIT(block_no)) != 0;
+}
+
+// returns the first free block in [from, end), or end if there is none
+unsigned
+BlockAllocator::next_free(unsigned from, unsigned end)
+{
+    unsigned i = from;
+    while (i < end) {
+        uint64_t word = bitmap[i / 64] >> (i % 64);
+        if (word) {
+            i += __builtin_ctzll(word);
+            return i < end ? i : end;
+        }
+        i = (i / 64 + 1) * 64;
+    }
+    return end;
+}
+
+// returns the number of consecutive free blocks starting at <from>,
+// counting at most <max> blocks and stopping at <end>
+unsigned
+BlockAllocator::run_length(unsigned from, unsigned end, unsigned max)
+{
+    unsigned i = from;
+    while (i < end && i - from < max) {
+        uint64_t used = ~bitmap[i / 64] >> (i % 64);
+        if (used) {
+            i += __builtin_ctzll(used);
+            break;
+        }
+        // the rest of this word is free
+        i = (i / 64 + 1) * 64;
+    }
+    if (i > end)
+        i = end;
+    return i - from < max ? i - from : max;
+}
+
+// next-fit search for <count> contiguous free blocks
+int
+BlockAllocator::find_run(unsigned count, unsigned &start)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned lo = pass ? first_block : cursor;
+        unsigned hi = pass ? cursor : no_blocks;
+        unsigned b = next_free(lo, hi);
+        while (b < hi) {
+            unsigned len = run_length(b, no_blocks, count);
+            if (len >= count) {
+                start = b;
+                return 0;
+            }
+            b = next_free(b + len, hi);
+        }
+    }
+    return -1;
+}
+
+// appends the run [start, start + count) to <blocks> and marks it used
+void
+BlockAllocator::take(unsigned start, unsigned count, std::vector<uint32_t> &blocks)
+{
+    for (unsigned i = 0; i < count; i++) {
+        blocks.push_back(start + i);
+        reserve(start + i);
+    }
+    cursor = start + count;
+}
+
+// allocates <count> blocks and appends them to <blocks> in chain order
+int
+BlockAllocator::allocate(unsigned count, std::vector<uint32_t> &blocks, unsigned goal)
+{
+    if (count == 0)
+        return 0;
+    if (count > free_count)
+        return -1;
+    if (goal < first_block || goal >= no_blocks)
+        goal = 0;
+
+    // a single run at the goal keeps a growing file contiguous
+    unsigned at_goal = goal ? run_length(goal, no_blocks, count) : 0;
+    if (at_goal >= count) {
+        take(goal, count, blocks);
+        return 0;
+    }
+
+    if (cursor < first_block || cursor >= no_blocks)
+        cursor = first_block;
+    unsigned start;
+    if (find_run(count, start) == 0) {
+        take(start, count, blocks);
+        return 0;
+    }
+
+    // no run is long enough: use what fits at the goal, then whole free
+    // runs in next-fit order so the file gets as few extents as possible
+    unsigned left = count;
+    if (at_goal > 0) {
+        take(goal, at_goal, blocks);
+        left -= at_goal;
+    }
+    if (cursor >= no_blocks)
+        cursor = first_block;
+    while (left > 0) {
+        unsigned b = next_free(cursor, no_blocks);
+        if (b >= no_blocks)
+            b = next_free(first_block, no_blocks);
+        unsigned len = run_length(b, no_blocks, left);
+        take(b, len, blocks);
+        left -= len;
+    }
+    return 0;
+}
+
+// marks a block as used
+void
+BlockAllocator::reserve(unsigned block_no)
+{
+    if (block_no < first_block || block_no >= no_blocks || !is_free(block_no))
+        return;
+    bitmap[block_no / 64] &= ~FREE_BIT(block_no);
+    free_count--;
+}
+
+// marks a block as free
+void
+BlockAllocator::release(unsigned block_no)
+{
+    if (block_no < first_block || block_no >= no_blocks || is_free(block_no))
+        return;
+    bitmap[block_no / 64] |= FREE_BIT(block_no);
+    free_count++;
+}
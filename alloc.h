@@ -0,0 +1,45 @@
+#include <cstdint>
+#include <vector>
+
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+// Free-block allocator. Keeps an in-memory bitmap of the free data blocks,
+// rebuilt from the FAT at mount and kept in sync through reserve()/release().
+class BlockAllocator {
+private:
+    // one bit per block, a set bit means the block is free
+    std::vector<uint64_t> bitmap;
+    unsigned first_block;
+    unsigned no_blocks;
+    unsigned free_count;
+    // next-fit cursor, searches start where the last allocation ended
+    unsigned cursor;
+
+    bool is_free(unsigned block_no);
+    unsigned next_free(unsigned from, unsigned end);
+    unsigned run_length(unsigned from, unsigned end, unsigned max);
+    int find_run(unsigned count, unsigned &start);
+    void take(unsigned start, unsigned count, std::vector<uint32_t> &blocks);
+public:
+    BlockAllocator();
+    // marks all <no_blocks> blocks as free, blocks below <first_block> are
+    // never handed out. The used blocks are then reserve()d.
+    void reset(unsigned first_block, unsigned no_blocks);
+    // allocates <count> blocks and appends them to <blocks> in chain order.
+    // Placement policy, in order of preference:
+    //  1. one run starting at <goal> (e.g. right after a file's last block)
+    //  2. one run anywhere, next-fit from the cursor
+    //  3. as much as fits at <goal>, then whole free runs in next-fit order
+    // A goal of 0 means no preference. The blocks are marked as used, the
+    // caller must release() them if they are not linked into the FAT.
+    // Returns 0 on success, -1 if there are not enough free blocks.
+    int allocate(unsigned count, std::vector<uint32_t> &blocks, unsigned goal = 0);
+    // marks a block as used
+    void reserve(unsigned block_no);
+    // marks a block as free
+    void release(unsigned block_no);
+    unsigned get_free_count() { return free_count; }
+};
+
+#endif // __ALLOC_H__
@@ -0,0 +1,487 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+// Microbenchmarks for the file system operations. Every operation is
+// timed one call at a time on a scratch disk image, the results are
+// printed as CSV (or JSON with --json): calls per second, median and 99th
+// percentile latency, and the blocks read and written per call.
+
+#define BENCH_DISK "bench.bin"
+#define BENCH_BLOCKS 65536 // 256 MB, sparse
+
+// swallows the output of cat, ls and pwd while they are timed
+class null_buf : public std::streambuf {
+protected:
+    int overflow(int c) { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) { return n; }
+};
+
+struct bench_result {
+    std::string op;
+    std::string param;
+    std::vector<double> lat_us; // one entry per call
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+};
+
+class Bench {
+private:
+    FS &fs;
+    std::ostream &out;
+    std::streambuf *out_buf;
+    null_buf null;
+    unsigned scale;
+    std::vector<bench_result> results;
+    bench_result *cur;
+    std::chrono::steady_clock::time_point t0;
+    disk_stats io0;
+
+    // times the code between start() and stop() as one call of cur
+    void start(const std::string& op, const std::string& param);
+    void begin_call();
+    void end_call();
+    unsigned count(unsigned n) { return std::max(1u, n / scale); }
+    void make_file(const std::string& path, unsigned size);
+    void fill_dir(const std::string& dir, unsigned entries);
+    std::string deep_path(unsigned depth);
+    void reset();
+
+    void bench_create();
+    void bench_cat();
+    void bench_cp();
+    void bench_mv();
+    void bench_rm();
+    void bench_append();
+    void bench_mkdir();
+    void bench_cd();
+    void bench_pwd();
+    void bench_ls();
+    void bench_resolve_path();
+public:
+    Bench(FS &fs, std::ostream &out, unsigned scale);
+    void run();
+    void print_csv();
+    void print_json();
+};
+
+static const unsigned file_sizes[] = { 0, 4096, 65536, 1 << 20 };
+static const unsigned fill_levels[] = { 16, 1024 };
+static const unsigned path_depths[] = { 1, 4, 16 };
+
+#define FOR_EACH(i, array) for (unsigned i = 0; i < sizeof(array) / sizeof(array[0]); i++)
+
+static std::string
+num(unsigned n)
+{
+    std::ostringstream s;
+    s << n;
+    return s.str();
+}
+
+Bench::Bench(FS &fs, std::ostream &out, unsigned scale)
+    : fs(fs), out(out), out_buf(out.rdbuf()), scale(scale), cur(nullptr)
+{
+}
+
+void
+Bench::start(const std::string& op, const std::string& param)
+{
+    results.push_back(bench_result());
+    cur = &results.back();
+    cur->op = op;
+    cur->param = param;
+    cur->blocks_read = 0;
+    cur->blocks_written = 0;
+}
+
+void
+Bench::begin_call()
+{
+    io0 = fs.get_disk_stats();
+    t0 = std::chrono::steady_clock::now();
+}
+
+void
+Bench::end_call()
+{
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    cur->lat_us.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+    const disk_stats& io = fs.get_disk_stats();
+    cur->blocks_read += io.blocks_read - io0.blocks_read;
+    cur->blocks_written += io.blocks_written - io0.blocks_written;
+}
+
+// returns <size> bytes of create input, lines of up to 63 characters
+static std::string
+file_data(unsigned size)
+{
+    std::string data;
+    data.reserve(size);
+    while (data.size() + 64 <= size) {
+        data.append(63, 'x');
+        data += '\n';
+    }
+    if (data.size() < size) {
+        data.append(size - data.size() - 1, 'x');
+        data += '\n';
+    }
+    return data;
+}
+
+// creates a file of <size> bytes
+void
+Bench::make_file(const std::string& path, unsigned size)
+{
+    std::istringstream in(file_data(size));
+    fs.create(path, in);
+}
+
+// creates <entries> empty files in <dir>
+void
+Bench::fill_dir(const std::string& dir, unsigned entries)
+{
+    fs.mkdir(dir);
+    for (unsigned i = 0; i < entries; i++) {
+        std::istringstream in("");
+        fs.create(dir + "/e" + num(i), in);
+    }
+}
+
+// returns /p/p/.../p with <depth> directories, creating them
+std::string
+Bench::deep_path(unsigned depth)
+{
+    std::string path;
+    for (unsigned i = 0; i < depth; i++) {
+        path += "/p";
+        fs.mkdir(path);
+    }
+    return path;
+}
+
+// starts over on an empty file system
+void
+Bench::reset()
+{
+    fs.cd("/");
+    fs.format(BENCH_BLOCKS);
+}
+
+void
+Bench::bench_create()
+{
+    FOR_EACH(s, file_sizes) {
+        reset();
+        unsigned n = count(file_sizes[s] >= (1 << 20) ? 20 : 400);
+        std::string data = file_data(file_sizes[s]);
+        start("create", "size=" + num(file_sizes[s]));
+        for (unsigned i = 0; i < n; i++) {
+            std::istringstream in(data);
+            begin_call();
+            fs.create("f" + num(i), in);
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_cat()
+{
+    FOR_EACH(s, file_sizes) {
+        reset();
+        make_file("f", file_sizes[s]);
+        unsigned n = count(file_sizes[s] >= (1 << 20) ? 50 : 1000);
+        start("cat", "size=" + num(file_sizes[s]));
+        std::ostream sink(&null);
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.cat("f", sink);
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_cp()
+{
+    static const char* modes[] = { "reflink", "copy" };
+    FOR_EACH(m, modes) {
+        FOR_EACH(s, file_sizes) {
+            reset();
+            make_file("f", file_sizes[s]);
+            unsigned n = count(file_sizes[s] >= (1 << 20) ? 20 : 400);
+            start("cp", "size=" + num(file_sizes[s]) + " " + modes[m]);
+            for (unsigned i = 0; i < n; i++) {
+                begin_call();
+                fs.cp("f", "c" + num(i), m == 0 ? CP_REFLINK_AUTO : CP_REFLINK_NEVER);
+                end_call();
+            }
+        }
+    }
+}
+
+void
+Bench::bench_mv()
+{
+    FOR_EACH(f, fill_levels) {
+        reset();
+        fill_dir("/d", fill_levels[f]);
+        unsigned n = count(std::min(fill_levels[f], 400u));
+        start("mv", "entries=" + num(fill_levels[f]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.mv("/d/e" + num(i), "/d/m" + num(i));
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_rm()
+{
+    FOR_EACH(s, file_sizes) {
+        reset();
+        unsigned n = count(file_sizes[s] >= (1 << 20) ? 20 : 400);
+        for (unsigned i = 0; i < n; i++) {
+            make_file("f" + num(i), file_sizes[s]);
+        }
+        start("rm", "size=" + num(file_sizes[s]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.rm("f" + num(i));
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_append()
+{
+    FOR_EACH(s, file_sizes) {
+        reset();
+        make_file("src", file_sizes[s]);
+        make_file("dst", 0);
+        unsigned n = count(file_sizes[s] >= (1 << 20) ? 20 : 400);
+        start("append", "size=" + num(file_sizes[s]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.append("src", "dst");
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_mkdir()
+{
+    FOR_EACH(f, fill_levels) {
+        reset();
+        fill_dir("/d", fill_levels[f]);
+        unsigned n = count(400);
+        start("mkdir", "entries=" + num(fill_levels[f]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.mkdir("/d/m" + num(i));
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_cd()
+{
+    FOR_EACH(d, path_depths) {
+        reset();
+        std::string path = deep_path(path_depths[d]);
+        unsigned n = count(2000);
+        start("cd", "depth=" + num(path_depths[d]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.cd(path);
+            end_call();
+            fs.cd("/");
+        }
+    }
+}
+
+void
+Bench::bench_pwd()
+{
+    FOR_EACH(d, path_depths) {
+        reset();
+        fs.cd(deep_path(path_depths[d]));
+        unsigned n = count(2000);
+        start("pwd", "depth=" + num(path_depths[d]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.pwd();
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_ls()
+{
+    FOR_EACH(f, fill_levels) {
+        reset();
+        fill_dir("/d", fill_levels[f]);
+        fs.cd("/d");
+        unsigned n = count(fill_levels[f] > 100 ? 100 : 1000);
+        start("ls", "entries=" + num(fill_levels[f]));
+        for (unsigned i = 0; i < n; i++) {
+            begin_call();
+            fs.ls();
+            end_call();
+        }
+    }
+}
+
+void
+Bench::bench_resolve_path()
+{
+    FOR_EACH(d, path_depths) {
+        reset();
+        std::string path = deep_path(path_depths[d]) + "/f";
+        unsigned n = count(5000);
+        start("resolve_path", "depth=" + num(path_depths[d]));
+        for (unsigned i = 0; i < n; i++) {
+            uint32_t dir_block;
+            std::string name;
+            begin_call();
+            fs.resolve_path(path, dir_block, name);
+            end_call();
+        }
+    }
+}
+
+// runs every benchmark, the file system's own output is discarded
+void
+Bench::run()
+{
+    out.rdbuf(&null);
+    bench_create();
+    bench_cat();
+    bench_cp();
+    bench_mv();
+    bench_rm();
+    bench_append();
+    bench_mkdir();
+    bench_cd();
+    bench_pwd();
+    bench_ls();
+    bench_resolve_path();
+    out.rdbuf(out_buf);
+}
+
+// returns the <p>th percentile of sorted latencies
+static double
+percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+struct bench_row {
+    double ops_per_sec, p50, p99, reads_per_op, writes_per_op;
+};
+
+static bench_row
+summarize(const bench_result& r)
+{
+    std::vector<double> sorted = r.lat_us;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (size_t i = 0; i < sorted.size(); i++)
+        total += sorted[i];
+    bench_row row;
+    size_t n = sorted.size();
+    row.ops_per_sec = total > 0 ? n * 1e6 / total : 0;
+    row.p50 = percentile(sorted, 50);
+    row.p99 = percentile(sorted, 99);
+    row.reads_per_op = n ? (double)r.blocks_read / n : 0;
+    row.writes_per_op = n ? (double)r.blocks_written / n : 0;
+    return row;
+}
+
+void
+Bench::print_csv()
+{
+    out << "op,param,calls,ops_per_sec,p50_us,p99_us,blocks_read_per_op,blocks_written_per_op\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        bench_row row = summarize(results[i]);
+        char line[256];
+        snprintf(line, sizeof(line), "%s,%s,%zu,%.0f,%.2f,%.2f,%.2f,%.2f\n",
+                 results[i].op.c_str(), results[i].param.c_str(), results[i].lat_us.size(),
+                 row.ops_per_sec, row.p50, row.p99, row.reads_per_op, row.writes_per_op);
+        out << line;
+    }
+}
+
+void
+Bench::print_json()
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        bench_row row = summarize(results[i]);
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "  {\"op\": \"%s\", \"param\": \"%s\", \"calls\": %zu, \"ops_per_sec\": %.0f, "
+                 "\"p50_us\": %.2f, \"p99_us\": %.2f, \"blocks_read_per_op\": %.2f, "
+                 "\"blocks_written_per_op\": %.2f}%s\n",
+                 results[i].op.c_str(), results[i].param.c_str(), results[i].lat_us.size(),
+                 row.ops_per_sec, row.p50, row.p99, row.reads_per_op, row.writes_per_op,
+                 i + 1 < results.size() ? "," : "");
+        out << line;
+    }
+    out << "]\n";
+}
+
+int
+main(int argc, char **argv)
+{
+    bool json = false;
+    int disk_mode = DISK_MODE_FILE;
+    unsigned scale = 1;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (std::strcmp(argv[i], "--mmap") == 0) {
+            disk_mode = DISK_MODE_MMAP;
+        } else if (std::strcmp(argv[i], "--quick") == 0) {
+            // a tenth of the calls, for a fast check
+            scale = 10;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--json] [--mmap] [--quick]\n";
+            return 1;
+        }
+    }
+    // a fresh scratch image, the shell's disk file is left alone
+    std::remove(BENCH_DISK);
+    std::streambuf *cout_buf = std::cout.rdbuf();
+    null_buf quiet;
+    std::cout.rdbuf(&quiet);
+    {
+        FS fs(disk_mode, BENCH_DISK);
+        std::cout.rdbuf(cout_buf);
+        Bench bench(fs, std::cout, scale);
+        bench.run();
+        if (json)
+            bench.print_json();
+        else
+            bench.print_csv();
+        std::cout.rdbuf(&quiet);
+    }
+    std::cout.rdbuf(cout_buf);
+    std::remove(BENCH_DISK);
+    return 0;
+}
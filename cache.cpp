@@ -0,0 +1,391 @@
+#include <iostream>
+#include <cstring>
+#include "cache.h"
+
+BlockRef::BlockRef(BlockRef &&other)
+    : cache(other.cache), block_no(other.block_no), data(other.data), mut(other.mut)
+{
+    other.data = nullptr;
+}
+
+BlockRef&
+BlockRef::operator=(BlockRef &&other)
+{
+    if (this != &other) {
+        release();
+        cache = other.cache;
+        block_no = other.block_no;
+        data = other.data;
+        mut = other.mut;
+        other.data = nullptr;
+    }
+    return *this;
+}
+
+// unpins the block, the handle is invalid afterwards
+void
+BlockRef::release()
+{
+    if (data != nullptr)
+        cache->unpin(block_no, mut);
+    data = nullptr;
+}
+
+// marks the block dirty after it was changed in place
+void
+BlockRef::set_dirty()
+{
+    if (data != nullptr)
+        cache->lookup(block_no)->dirty = true;
+}
+
+BlockCache::BlockCache(Disk &disk, unsigned capacity) : disk(disk), capacity(capacity)
+{
+    reset_stats();
+    if (this->capacity == 0)
+        this->capacity = 1;
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+// returns the cached block or nullptr on a miss
+BlockCache::cache_block*
+BlockCache::lookup(unsigned block_no)
+{
+    std::map<unsigned, cache_block>::iterator it = blocks.find(block_no);
+    if (it == blocks.end())
+        return nullptr;
+    touch(&it->second);
+    return &it->second;
+}
+
+// adds an (uninitialized) block to the cache, evicting old blocks if full
+BlockCache::cache_block*
+BlockCache::insert(unsigned block_no)
+{
+    // when every block is pinned the cache grows past its capacity
+    while (blocks.size() >= capacity && evict())
+        ;
+    cache_block &cb = blocks[block_no];
+    cb.dirty = false;
+    cb.logged = false;
+    cb.pins = 0;
+    cb.lru_pos = lru.insert(lru.end(), block_no);
+    return &cb;
+}
+
+// moves a block to the most recently used end of the LRU list
+void
+BlockCache::touch(cache_block *cb)
+{
+    lru.splice(lru.end(), lru, cb->lru_pos);
+}
+
+// removes the least recently used unpinned block, writing it back if
+// dirty. Held dirty blocks and logged blocks are skipped like pinned ones.
+// Returns false if every cached block is pinned, held or logged.
+bool
+BlockCache::evict()
+{
+    std::list<unsigned>::iterator pos;
+    for (pos = lru.begin(); pos != lru.end(); ++pos) {
+        std::map<unsigned, cache_block>::iterator it = blocks.find(*pos);
+        if (it->second.pins > 0 || it->second.logged ||
+            (it->second.dirty && hold && hold(*pos)))
+            continue;
+        if (it->second.dirty) {
+            disk.write(*pos, it->second.data);
+            stats.writebacks++;
+        }
+        stats.evictions++;
+        lru.erase(pos);
+        blocks.erase(it);
+        return true;
+    }
+    return false;
+}
+
+// returns the cached block, reading it from the disk on a miss
+BlockCache::cache_block*
+BlockCache::load(unsigned block_no)
+{
+    cache_block *cb = lookup(block_no);
+    if (cb != nullptr) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        if (block_no >= disk.get_no_blocks()) {
+            std::cout << "BlockCache::read - ERROR: Invalid block number (" << block_no << ")\n";
+            return nullptr;
+        }
+        cb = insert(block_no);
+        if (disk.read(block_no, cb->data)) {
+            lru.erase(cb->lru_pos);
+            blocks.erase(block_no);
+            return nullptr;
+        }
+    }
+    return cb;
+}
+
+void
+BlockCache::unpin(unsigned block_no, bool dirty)
+{
+    std::map<unsigned, cache_block>::iterator it = blocks.find(block_no);
+    if (it == blocks.end() || it->second.pins == 0)
+        return;
+    it->second.pins--;
+    if (dirty)
+        it->second.dirty = true;
+}
+
+// reads one block, from memory if cached
+int
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    cache_block *cb = load(block_no);
+    if (cb == nullptr)
+        return -1;
+    std::memcpy(blk, cb->data, BLOCK_SIZE);
+    return 0;
+}
+
+// pins a block for reading in place, the handle is invalid on errors
+BlockRef
+BlockCache::get_block(unsigned block_no)
+{
+    cache_block *cb = load(block_no);
+    if (cb == nullptr)
+        return BlockRef();
+    cb->pins++;
+    return BlockRef(this, block_no, cb->data, false);
+}
+
+// pins a block for changing in place, the block is marked dirty
+BlockRef
+BlockCache::get_block_mut(unsigned block_no)
+{
+    cache_block *cb = load(block_no);
+    if (cb == nullptr)
+        return BlockRef();
+    cb->pins++;
+    cb->dirty = true;
+    return BlockRef(this, block_no, cb->data, true);
+}
+
+// writes one block into the cache and marks it dirty
+int
+BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    cache_block *cb = lookup(block_no);
+    if (cb == nullptr) {
+        if (block_no >= disk.get_no_blocks()) {
+            std::cout << "BlockCache::write - ERROR: Invalid block number (" << block_no << ")\n";
+            return -1;
+        }
+        cb = insert(block_no);
+    }
+    std::memcpy(cb->data, blk, BLOCK_SIZE);
+    cb->dirty = true;
+    return 0;
+}
+
+// reads a list of blocks into <bufs>, cached blocks are copied from memory
+// and the misses are fetched from the disk with one vectored call
+int
+BlockCache::read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs)
+{
+    std::vector<unsigned> miss_nos;
+    std::vector<uint8_t*> miss_bufs;
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        cache_block *cb = lookup(block_nos[i]);
+        if (cb != nullptr) {
+            std::memcpy(bufs[i], cb->data, BLOCK_SIZE);
+        } else {
+            miss_nos.push_back(block_nos[i]);
+            miss_bufs.push_back(bufs[i]);
+        }
+    }
+    stats.hits += block_nos.size() - miss_nos.size();
+    stats.misses += miss_nos.size();
+    if (miss_nos.empty())
+        return 0;
+    if (disk.read_blocks(miss_nos, miss_bufs))
+        return -1;
+    // keep clean copies of the blocks that were read
+    for (size_t i = 0; i < miss_nos.size(); i++) {
+        if (lookup(miss_nos[i]) == nullptr)
+            std::memcpy(insert(miss_nos[i])->data, miss_bufs[i], BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// starts reading the blocks that are not cached in the background, they
+// are fetched from the host's page cache when they are read later
+void
+BlockCache::prefetch(const std::vector<unsigned>& block_nos)
+{
+    std::vector<unsigned> miss_nos;
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        if (blocks.find(block_nos[i]) == blocks.end())
+            miss_nos.push_back(block_nos[i]);
+    }
+    if (!miss_nos.empty())
+        disk.prefetch(miss_nos);
+}
+
+// lists the dirty blocks for which <pick> returns true, in block order
+void
+BlockCache::dirty_blocks(const std::function<bool(unsigned)>& pick,
+                         std::vector<unsigned>& block_nos, std::vector<uint8_t*>& bufs)
+{
+    std::map<unsigned, cache_block>::iterator it;
+    for (it = blocks.begin(); it != blocks.end(); ++it) {
+        if (it->second.dirty && pick(it->first)) {
+            block_nos.push_back(it->first);
+            bufs.push_back(it->second.data);
+        }
+    }
+}
+
+// counts the dirty blocks for which <pick> returns true
+unsigned
+BlockCache::count_dirty(const std::function<bool(unsigned)>& pick)
+{
+    unsigned n = 0;
+    std::map<unsigned, cache_block>::iterator it;
+    for (it = blocks.begin(); it != blocks.end(); ++it) {
+        if (it->second.dirty && pick(it->first))
+            n++;
+    }
+    return n;
+}
+
+// writes the dirty blocks picked by <pick> (all if it is empty) in block
+// order, <wrote> tells if there were any
+int
+BlockCache::write_dirty(const std::function<bool(unsigned)>& pick, bool& wrote)
+{
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> bufs;
+    std::map<unsigned, cache_block>::iterator it;
+    for (it = blocks.begin(); it != blocks.end(); ++it) {
+        if (!it->second.dirty || (pick && !pick(it->first)))
+            continue;
+        block_nos.push_back(it->first);
+        bufs.push_back(it->second.data);
+        it->second.dirty = false;
+    }
+    wrote = !block_nos.empty();
+    if (!wrote)
+        return 0;
+    stats.writebacks += block_nos.size();
+    // adjacent dirty blocks go out in one pwritev() call
+    return disk.write_blocks(block_nos, bufs);
+}
+
+// writes the dirty blocks for which <pick> returns true to the disk
+int
+BlockCache::write_back(const std::function<bool(unsigned)>& pick)
+{
+    bool wrote;
+    return write_dirty(pick, wrote);
+}
+
+// writes all dirty blocks to the disk, in block order, and flushes it
+int
+BlockCache::sync()
+{
+    bool wrote;
+    int ret = write_dirty(std::function<bool(unsigned)>(), wrote);
+    if (wrote && disk.flush())
+        ret = -1;
+    return ret;
+}
+
+// drops all unpinned cached blocks, dirty blocks are written first
+int
+BlockCache::invalidate()
+{
+    int ret = sync();
+    while (evict())
+        ;
+    return ret;
+}
+
+// drops all unpinned cached blocks without writing the dirty ones
+void
+BlockCache::discard()
+{
+    std::list<unsigned>::iterator pos = lru.begin();
+    while (pos != lru.end()) {
+        std::map<unsigned, cache_block>::iterator it = blocks.find(*pos);
+        if (it->second.pins > 0) {
+            ++pos;
+            continue;
+        }
+        pos = lru.erase(pos);
+        blocks.erase(it);
+    }
+}
+
+// marks the blocks as written to the journal, clean but kept cached
+void
+BlockCache::set_logged(const std::vector<unsigned>& block_nos)
+{
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        std::map<unsigned, cache_block>::iterator it = blocks.find(block_nos[i]);
+        if (it != blocks.end()) {
+            it->second.dirty = false;
+            it->second.logged = true;
+        }
+    }
+}
+
+// copies a logged block that was not changed since it was logged
+int
+BlockCache::read_logged(unsigned block_no, uint8_t *blk)
+{
+    std::map<unsigned, cache_block>::iterator it = blocks.find(block_no);
+    if (it == blocks.end() || !it->second.logged || it->second.dirty)
+        return -1;
+    std::memcpy(blk, it->second.data, BLOCK_SIZE);
+    return 0;
+}
+
+// the logged blocks are in place, they can be evicted again
+void
+BlockCache::clear_logged()
+{
+    std::map<unsigned, cache_block>::iterator it;
+    for (it = blocks.begin(); it != blocks.end(); ++it)
+        it->second.logged = false;
+    while (blocks.size() > capacity && evict())
+        ;
+}
+
+// updates a clean cached copy of a block written to the disk directly
+void
+BlockCache::refresh(unsigned block_no, const uint8_t *blk)
+{
+    std::map<unsigned, cache_block>::iterator it = blocks.find(block_no);
+    if (it != blocks.end() && !it->second.dirty)
+        std::memcpy(it->second.data, blk, BLOCK_SIZE);
+}
+
+void
+BlockCache::reset_stats()
+{
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+void
+BlockCache::set_capacity(unsigned n)
+{
+    capacity = n ? n : 1;
+    while (blocks.size() > capacity && evict())
+        ;
+}
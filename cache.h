@@ -0,0 +1,137 @@
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <vector>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// default number of blocks kept in memory (1 MB)
+#define CACHE_BLOCKS 256
+
+class BlockCache;
+
+// block cache counters
+struct cache_stats {
+    uint64_t hits; // blocks read from memory
+    uint64_t misses; // blocks read from the disk
+    uint64_t evictions;
+    uint64_t writebacks; // dirty blocks written to the disk
+};
+
+// Handle to a block pinned in the cache. The block stays cached, at the
+// same address, until the handle is released or destroyed, so callers can
+// look at it in place (e.g. as an array of dir_entry) without copying.
+class BlockRef {
+private:
+    BlockCache *cache;
+    unsigned block_no;
+    uint8_t *data;
+    // set for handles from get_block_mut(), the block is marked dirty again
+    // when the handle is released
+    bool mut;
+public:
+    BlockRef() : cache(nullptr), block_no(0), data(nullptr), mut(false) {}
+    BlockRef(BlockCache *cache, unsigned block_no, uint8_t *data, bool mut)
+        : cache(cache), block_no(block_no), data(data), mut(mut) {}
+    BlockRef(BlockRef &&other);
+    BlockRef& operator=(BlockRef &&other);
+    BlockRef(const BlockRef&) = delete;
+    BlockRef& operator=(const BlockRef&) = delete;
+    ~BlockRef() { release(); }
+    // unpins the block, the handle is invalid afterwards
+    void release();
+    // marks the block dirty after it was changed in place
+    void set_dirty();
+    bool valid() const { return data != nullptr; }
+    unsigned get_block_no() const { return block_no; }
+    uint8_t* bytes() { return data; }
+    template<class T> T* as() { return (T*)data; }
+};
+
+// Write-back block cache in front of the Disk. Writes only mark the cached
+// copy dirty; dirty blocks reach the disk at sync() or when they are evicted.
+class BlockCache {
+private:
+    struct cache_block {
+        uint8_t data[BLOCK_SIZE];
+        bool dirty;
+        // in the journal but not yet written in place, kept until the
+        // journal is checkpointed
+        bool logged;
+        // number of BlockRefs holding the block, pinned blocks are not evicted
+        unsigned pins;
+        std::list<unsigned>::iterator lru_pos;
+    };
+    Disk &disk;
+    unsigned capacity;
+    // dirty blocks this returns true for are not evicted, they are kept
+    // until write_back() or sync() writes them
+    std::function<bool(unsigned)> hold;
+    // cached blocks, ordered by block number so sync() writes in disk order
+    std::map<unsigned, cache_block> blocks;
+    // least recently used block at the front
+    std::list<unsigned> lru;
+    cache_stats stats;
+
+    cache_block* lookup(unsigned block_no);
+    cache_block* insert(unsigned block_no);
+    cache_block* load(unsigned block_no);
+    void touch(cache_block *cb);
+    bool evict();
+    void unpin(unsigned block_no, bool dirty);
+    int write_dirty(const std::function<bool(unsigned)>& pick, bool& wrote);
+    friend class BlockRef;
+public:
+    BlockCache(Disk &disk, unsigned capacity = CACHE_BLOCKS);
+    ~BlockCache();
+    // reads one block, from memory if cached
+    int read(unsigned block_no, uint8_t *blk);
+    // pins a block for reading in place, the handle is invalid on errors
+    BlockRef get_block(unsigned block_no);
+    // pins a block for changing in place, the block is marked dirty
+    BlockRef get_block_mut(unsigned block_no);
+    // writes one block into the cache and marks it dirty
+    int write(unsigned block_no, uint8_t *blk);
+    // reads a list of blocks into <bufs> (one buffer per block), the
+    // misses are fetched from the disk with vectored reads
+    int read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs);
+    // starts reading the uncached blocks of <block_nos> in the background
+    void prefetch(const std::vector<unsigned>& block_nos);
+    // lists the dirty blocks for which <pick> returns true, in block order.
+    // The buffers point into the cache and are valid until it is used again
+    void dirty_blocks(const std::function<bool(unsigned)>& pick,
+                      std::vector<unsigned>& block_nos, std::vector<uint8_t*>& bufs);
+    // counts the dirty blocks for which <pick> returns true
+    unsigned count_dirty(const std::function<bool(unsigned)>& pick);
+    // writes the dirty blocks for which <pick> returns true to the disk,
+    // in block order, without flushing it
+    int write_back(const std::function<bool(unsigned)>& pick);
+    // writes all dirty blocks to the disk and flushes it
+    int sync();
+    // drops all unpinned cached blocks, dirty blocks are written first
+    int invalidate();
+    // drops all unpinned cached blocks without writing the dirty ones
+    void discard();
+    // marks the blocks as written to the journal: they are clean but
+    // stay cached, their place on the disk is still out of date
+    void set_logged(const std::vector<unsigned>& block_nos);
+    // copies a logged block as it was logged, returns -1 if it is not
+    // logged or was changed since
+    int read_logged(unsigned block_no, uint8_t *blk);
+    // the logged blocks reached their place, they can be evicted again
+    void clear_logged();
+    // updates the cached copy of a block written to the disk directly,
+    // a dirty copy is newer and is kept
+    void refresh(unsigned block_no, const uint8_t *blk);
+    // dirty blocks for which <hold> returns true stay cached until written
+    void set_hold(const std::function<bool(unsigned)>& hold) { this->hold = hold; }
+    const cache_stats& get_stats() { return stats; }
+    void reset_stats();
+    unsigned get_capacity() { return capacity; }
+    void set_capacity(unsigned n);
+};
+
+#endif // __CACHE_H__
@@ -0,0 +1,110 @@
+#include "dcache.h"
+
+DentryCache::DentryCache(unsigned capacity) : capacity(capacity)
+{
+    if (this->capacity == 0)
+        this->capacity = 1;
+}
+
+// returns true and fills <d> if the name is cached
+bool
+DentryCache::lookup(unsigned dir_block, const std::string& name, dentry& d)
+{
+    std::map<key_type, node>::iterator it = entries.find(key_type(dir_block, name));
+    if (it == entries.end())
+        return false;
+    lru.splice(lru.end(), lru, it->second.lru_pos);
+    d = it->second.d;
+    return true;
+}
+
+// caches the lookup result <d>, evicting the oldest name if full
+void
+DentryCache::insert(unsigned dir_block, const std::string& name, const dentry& d)
+{
+    key_type key(dir_block, name);
+    std::map<key_type, node>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        it->second.d = d;
+        lru.splice(lru.end(), lru, it->second.lru_pos);
+        return;
+    }
+    if (entries.size() >= capacity) {
+        entries.erase(lru.front());
+        lru.pop_front();
+    }
+    node &n = entries[key];
+    n.d = d;
+    n.lru_pos = lru.insert(lru.end(), key);
+}
+
+// drops one name
+void
+DentryCache::remove(unsigned dir_block, const std::string& name)
+{
+    std::map<key_type, node>::iterator it = entries.find(key_type(dir_block, name));
+    if (it == entries.end())
+        return;
+    lru.erase(it->second.lru_pos);
+    entries.erase(it);
+}
+
+// drops every name cached for a directory
+void
+DentryCache::remove_dir(unsigned dir_block)
+{
+    std::map<key_type, node>::iterator it = entries.lower_bound(key_type(dir_block, ""));
+    while (it != entries.end() && it->first.first == dir_block) {
+        lru.erase(it->second.lru_pos);
+        entries.erase(it++);
+    }
+}
+
+// drops everything
+void
+DentryCache::clear()
+{
+    entries.clear();
+    lru.clear();
+}
+
+// returns the slot holding <name>, or -1
+int
+DirIndex::find(const std::string& name)
+{
+    std::unordered_map<std::string, int>::iterator it = slots.find(name);
+    return it == slots.end() ? -1 : it->second;
+}
+
+// returns the lowest free slot, or -1 if the directory is full
+int
+DirIndex::first_free()
+{
+    return free_slots.empty() ? -1 : *free_slots.begin();
+}
+
+// records that <name> was written to <slot>
+void
+DirIndex::add(const std::string& name, int slot)
+{
+    free_slots.erase(slot);
+    slots[name] = slot;
+}
+
+// records that the slot holding <name> was cleared
+void
+DirIndex::remove(const std::string& name)
+{
+    std::unordered_map<std::string, int>::iterator it = slots.find(name);
+    if (it == slots.end())
+        return;
+    free_slots.insert(it->second);
+    slots.erase(it);
+}
+
+// records that <slot> is free
+void
+DirIndex::add_free(int slot)
+{
+    free_slots.insert(slot);
+}
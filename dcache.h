@@ -0,0 +1,72 @@
+#include <cstdint>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+// default number of names kept in the dentry cache
+#define DCACHE_ENTRIES 1024
+
+// Cached result of looking up one name in a directory. A negative entry
+// (idx == -1) records that the name does not exist.
+struct dentry {
+    int idx; // slot of the entry in the directory, -1 if not found
+    uint32_t first_blk;
+    uint8_t type;
+};
+
+// Directory entry cache, maps (directory block, name) to the result of
+// the lookup so repeated path resolution does not scan directory blocks.
+// FS drops the affected names whenever a directory is changed.
+class DentryCache {
+private:
+    typedef std::pair<unsigned, std::string> key_type;
+    struct node {
+        dentry d;
+        std::list<key_type>::iterator lru_pos;
+    };
+    unsigned capacity;
+    // ordered by directory block, so a whole directory can be dropped
+    std::map<key_type, node> entries;
+    // least recently used name at the front
+    std::list<key_type> lru;
+public:
+    DentryCache(unsigned capacity = DCACHE_ENTRIES);
+    // returns true and fills <d> if the name is cached
+    bool lookup(unsigned dir_block, const std::string& name, dentry& d);
+    // caches the lookup result <d>, evicting the oldest name if full
+    void insert(unsigned dir_block, const std::string& name, const dentry& d);
+    // drops one name
+    void remove(unsigned dir_block, const std::string& name);
+    // drops every name cached for a directory
+    void remove_dir(unsigned dir_block);
+    // drops everything
+    void clear();
+};
+
+// In-memory index of one directory: hashes names to slot numbers and keeps
+// the free slots, so lookups and inserts do not scan the directory block.
+// FS builds it from the directory block the first time the directory is used.
+class DirIndex {
+private:
+    std::unordered_map<std::string, int> slots;
+    // free slots in order, new entries take the lowest one
+    std::set<int> free_slots;
+public:
+    // returns the slot holding <name>, or -1
+    int find(const std::string& name);
+    // returns the lowest free slot, or -1 if the directory is full
+    int first_free();
+    // records that <name> was written to <slot>
+    void add(const std::string& name, int slot);
+    // records that the slot holding <name> was cleared
+    void remove(const std::string& name);
+    // records that <slot> is free
+    void add_free(int slot);
+};
+
+#endif // __DCACHE_H__
@@ -1,33 +1,154 @@
 #include <iostream>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <cstring>
 #include "disk.h"
 
-Disk::Disk()
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+Disk::Disk(int mode, const std::string& name) : mode(mode), map(nullptr), no_blocks(DISK_BLOCKS), name(name),
+    write_behind(false), wb_queued(0), wb_busy(false), wb_stop(false), wb_error(false)
 {
+    reset_stats();
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    bool exists = disk_file_exists(name);
+    if (!exists) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
+        std::cout << "Creating disk file: " << name << std::endl;
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+    fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    struct stat st;
+    off_t size = 0;
+    if (exists && fstat(fd, &st) == 0)
+        size = st.st_size;
+    if (size >= BLOCK_SIZE)
+        no_blocks = size / BLOCK_SIZE;
+    disk_size = (uint64_t)no_blocks * BLOCK_SIZE;
+    // a new file, or one shorter than a block, gets DISK_BLOCKS. Reads past
+    // the end of the file would fail and a mapping past it would fault.
+    if (size < (off_t)disk_size && ftruncate(fd, disk_size) != 0) {
+        std::cerr << "ERROR: Can't create diskfile: " << name << ", exiting..."<< std::endl;
         exit(-1);
     }
+    if (mode == DISK_MODE_MMAP)
+        map_disk();
+}
+
+// maps the whole disk file, falls back to file I/O if that fails
+int
+Disk::map_disk()
+{
+    void *p = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "WARNING: Can't mmap diskfile: " << name << ", using file I/O" << std::endl;
+        mode = DISK_MODE_FILE;
+        return -1;
+    }
+    map = (uint8_t*)p;
+    return 0;
+}
+
+// msyncs the mapped blocks written since the last MS_SYNC, runs of
+// adjacent blocks as one range. Ranges start on a page boundary.
+int
+Disk::sync_map(int flags)
+{
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    int ret = 0;
+    std::set<unsigned>::iterator it = map_dirty.begin();
+    while (it != map_dirty.end()) {
+        unsigned first = *it, last = *it;
+        while (++it != map_dirty.end() && *it == last + 1)
+            last = *it;
+        size_t start = (size_t)first * BLOCK_SIZE / page * page;
+        size_t end = (size_t)(last + 1) * BLOCK_SIZE;
+        if (msync(map + start, end - start, flags))
+            ret = -1;
+    }
+    if (flags == MS_SYNC && ret == 0)
+        map_dirty.clear();
+    return ret;
+}
+
+// changes the size of the disk file to <no_blocks> blocks, the file is
+// sparse so unused blocks take no space on the host disk
+int
+Disk::resize(unsigned no_blocks)
+{
+    if (DEBUG)
+        std::cout << "Disk::resize(" << no_blocks << ")\n";
+    if (no_blocks == 0)
+        return -1;
+    // queued blocks are written at the old size
+    if (write_behind && drain())
+        return -1;
+    if (map != nullptr) {
+        munmap(map, disk_size);
+        map = nullptr;
+        map_dirty.clear();
+    }
+    int ret = 0;
+    if (ftruncate(fd, (off_t)no_blocks * BLOCK_SIZE) == 0) {
+        this->no_blocks = no_blocks;
+        disk_size = (uint64_t)no_blocks * BLOCK_SIZE;
+    } else {
+        ret = -1;
+    }
+    // remap at the new size, map_disk() falls back to file I/O on errors
+    if (mode == DISK_MODE_MMAP)
+        map_disk();
+    return ret;
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    // writes out the queue and stops the flusher thread
+    set_write_behind(false);
+    if (map != nullptr)
+        munmap(map, disk_size);
+    close(fd);
 }
 
 bool
 Disk::disk_file_exists (const std::string& name) {
-    std::ifstream f(name.c_str());
-    return f.good();
+    return access(name.c_str(), F_OK) == 0;
+}
+
+// moves whole iovecs to/from the disk file at <offset>, resuming after
+// partial transfers
+static int
+transfer_run(int fd, struct iovec *iov, int iovcnt, off_t offset, bool do_write)
+{
+    while (iovcnt > 0) {
+        ssize_t n = do_write ? pwritev(fd, iov, iovcnt, offset) : preadv(fd, iov, iovcnt, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
 }
 
 // writes one block to the disk
@@ -41,11 +162,17 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
-    return 0;
+    stats.blocks_written++;
+    stats.bytes_written += BLOCK_SIZE;
+    if (write_behind)
+        return queue_blocks(std::vector<unsigned>(1, block_no), std::vector<uint8_t*>(1, blk));
+    if (map != nullptr) {
+        std::memcpy(map + (size_t)block_no * BLOCK_SIZE, blk, BLOCK_SIZE);
+        map_dirty.insert(block_no);
+        return 0;
+    }
+    struct iovec iov = { blk, BLOCK_SIZE };
+    return transfer_run(fd, &iov, 1, (off_t)block_no * BLOCK_SIZE, true);
 }
 
 // reads one block from the disk
@@ -59,8 +186,308 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    stats.blocks_read++;
+    stats.bytes_read += BLOCK_SIZE;
+    if (write_behind && queued_block(block_no, blk))
+        return 0;
+    if (map != nullptr) {
+        std::memcpy(blk, map + (size_t)block_no * BLOCK_SIZE, BLOCK_SIZE);
+        return 0;
+    }
+    struct iovec iov = { blk, BLOCK_SIZE };
+    return transfer_run(fd, &iov, 1, (off_t)block_no * BLOCK_SIZE, false);
+}
+
+// moves a list of blocks, coalescing runs of adjacent block numbers into
+// one vectored call each
+int
+Disk::transfer_blocks(const std::vector<unsigned>& block_nos,
+                      const std::vector<uint8_t*>& bufs, bool do_write)
+{
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        if (block_nos[i] >= no_blocks) {
+            std::cout << "Disk::" << (do_write ? "write" : "read") << "_blocks - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+    }
+    if (map != nullptr) {
+        for (size_t i = 0; i < block_nos.size(); i++) {
+            uint8_t *blk = map + (size_t)block_nos[i] * BLOCK_SIZE;
+            if (do_write) {
+                std::memcpy(blk, bufs[i], BLOCK_SIZE);
+                map_dirty.insert(block_nos[i]);
+            } else
+                std::memcpy(bufs[i], blk, BLOCK_SIZE);
+        }
+        return 0;
+    }
+    std::vector<struct iovec> iov;
+    size_t i = 0;
+    while (i < block_nos.size()) {
+        // collect the run block_nos[i] .. block_nos[j-1]
+        size_t j = i + 1;
+        while (j < block_nos.size() && block_nos[j] == block_nos[j - 1] + 1 && j - i < IOV_MAX)
+            j++;
+        if (DEBUG)
+            std::cout << "Disk::" << (do_write ? "write" : "read") << "_blocks(" << block_nos[i] << ", " << j - i << ")\n";
+        iov.resize(j - i);
+        for (size_t k = i; k < j; k++) {
+            iov[k - i].iov_base = bufs[k];
+            iov[k - i].iov_len = BLOCK_SIZE;
+        }
+        if (transfer_run(fd, &iov[0], j - i, (off_t)block_nos[i] * BLOCK_SIZE, do_write))
+            return -1;
+        i = j;
+    }
     return 0;
 }
+
+// reads the blocks <block_nos> into <bufs>, adjacent blocks are read with
+// a single preadv() call
+int
+Disk::read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs)
+{
+    stats.blocks_read += block_nos.size();
+    stats.bytes_read += (uint64_t)block_nos.size() * BLOCK_SIZE;
+    if (!write_behind)
+        return transfer_blocks(block_nos, bufs, false);
+    // blocks still in the write-behind queue are newer than the disk file
+    std::vector<unsigned> file_nos;
+    std::vector<uint8_t*> file_bufs;
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        if (block_nos[i] < no_blocks && queued_block(block_nos[i], bufs[i]))
+            continue;
+        file_nos.push_back(block_nos[i]);
+        file_bufs.push_back(bufs[i]);
+    }
+    return transfer_blocks(file_nos, file_bufs, false);
+}
+
+// writes <bufs> to the blocks <block_nos>, adjacent blocks are written
+// with a single pwritev() call
+int
+Disk::write_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs)
+{
+    stats.blocks_written += block_nos.size();
+    stats.bytes_written += (uint64_t)block_nos.size() * BLOCK_SIZE;
+    if (!write_behind)
+        return transfer_blocks(block_nos, bufs, true);
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        if (block_nos[i] >= no_blocks) {
+            std::cout << "Disk::write_blocks - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+    }
+    return queue_blocks(block_nos, bufs);
+}
+
+// hints that the blocks <block_nos> will be read soon, so the host starts
+// reading them in the background. Runs of adjacent blocks are hinted as
+// one range.
+void
+Disk::prefetch(const std::vector<unsigned>& block_nos)
+{
+    size_t i = 0;
+    while (i < block_nos.size()) {
+        size_t j = i + 1;
+        while (j < block_nos.size() && block_nos[j] == block_nos[j - 1] + 1)
+            j++;
+        if (block_nos[j - 1] < no_blocks) {
+            if (DEBUG)
+                std::cout << "Disk::prefetch(" << block_nos[i] << ", " << j - i << ")\n";
+            off_t offset = (off_t)block_nos[i] * BLOCK_SIZE;
+            size_t len = (j - i) * BLOCK_SIZE;
+            // only a hint, errors are ignored
+            if (map != nullptr)
+                madvise(map + offset, len, MADV_WILLNEED);
+            else
+                posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+        }
+        i = j;
+    }
+}
+
+// flushes written blocks to the disk file
+int
+Disk::flush()
+{
+    if (DEBUG)
+        std::cout << "Disk::flush()\n";
+    stats.flushes++;
+    // pwrite() hands the data straight to the kernel, there is no
+    // user-space buffer left to flush. Mapped pages are queued for writeback,
+    // and the write-behind queue is already being drained.
+    if (map != nullptr)
+        return sync_map(MS_ASYNC);
+    return 0;
+}
+
+// waits until all written blocks are durable on the host disk
+int
+Disk::sync()
+{
+    if (DEBUG)
+        std::cout << "Disk::sync()\n";
+    stats.syncs++;
+    if (map != nullptr)
+        return sync_map(MS_SYNC);
+    int ret = write_behind ? drain() : 0;
+    if (fdatasync(fd))
+        ret = -1;
+    return ret;
+}
+
+void
+Disk::reset_stats()
+{
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+// turns write-behind on or off
+int
+Disk::set_write_behind(bool on)
+{
+    if (on == write_behind)
+        return 0;
+    if (on) {
+        // mapped writes are plain memory copies, there is nothing to defer
+        if (map != nullptr)
+            return -1;
+        wb_stop = false;
+        wb_error = false;
+        write_behind = true;
+        flusher = std::thread(&Disk::flush_loop, this);
+        return 0;
+    }
+    int ret = drain();
+    {
+        std::lock_guard<std::mutex> guard(wb_lock);
+        wb_stop = true;
+    }
+    wb_work.notify_one();
+    flusher.join();
+    wb_epochs.clear();
+    write_behind = false;
+    return ret;
+}
+
+// copies blocks into the open epoch at the back of the queue, a block
+// queued again in the same epoch replaces its older copy. Waits while the
+// queue is full.
+int
+Disk::queue_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs)
+{
+    std::unique_lock<std::mutex> guard(wb_lock);
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        if (wb_epochs.empty() || wb_epochs.back().closed)
+            wb_epochs.push_back(wb_epoch());
+        std::map<unsigned, std::vector<uint8_t> > *blocks = &wb_epochs.back().blocks;
+        std::map<unsigned, std::vector<uint8_t> >::iterator it = blocks->find(block_nos[i]);
+        if (it == blocks->end()) {
+            while (wb_queued >= WB_QUEUE_BLOCKS) {
+                wb_work.notify_one();
+                wb_done.wait(guard);
+            }
+            // the flusher may have taken blocks from the epoch meanwhile
+            blocks = &wb_epochs.back().blocks;
+            it = blocks->insert(std::make_pair(block_nos[i], std::vector<uint8_t>(BLOCK_SIZE))).first;
+            wb_queued++;
+        }
+        std::memcpy(&it->second[0], bufs[i], BLOCK_SIZE);
+    }
+    wb_work.notify_one();
+    return 0;
+}
+
+// copies the newest queued version of <block_no> into <blk>, returns false
+// if the block is not queued
+bool
+Disk::queued_block(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(wb_lock);
+    for (std::deque<wb_epoch>::reverse_iterator e = wb_epochs.rbegin(); e != wb_epochs.rend(); ++e) {
+        std::map<unsigned, std::vector<uint8_t> >::iterator it = e->blocks.find(block_no);
+        if (it != e->blocks.end()) {
+            std::memcpy(blk, &it->second[0], BLOCK_SIZE);
+            return true;
+        }
+    }
+    std::map<unsigned, std::vector<uint8_t> >::iterator it = wb_inflight.find(block_no);
+    if (it == wb_inflight.end())
+        return false;
+    std::memcpy(blk, &it->second[0], BLOCK_SIZE);
+    return true;
+}
+
+// ends the current epoch, nothing written after the barrier reaches the
+// disk file before the epoch is written and synced. Without write-behind
+// the blocks written so far are synced right away.
+int
+Disk::barrier()
+{
+    stats.barriers++;
+    if (map != nullptr)
+        return sync_map(MS_SYNC);
+    if (!write_behind)
+        return fdatasync(fd) ? -1 : 0;
+    std::lock_guard<std::mutex> guard(wb_lock);
+    if (!wb_epochs.empty() && !wb_epochs.back().closed) {
+        wb_epochs.back().closed = true;
+        wb_work.notify_one();
+    }
+    return 0;
+}
+
+// waits until the flusher has written every queued block, returns -1 if
+// any write failed since the last drain
+int
+Disk::drain()
+{
+    std::unique_lock<std::mutex> guard(wb_lock);
+    while (wb_busy || wb_queued > 0 || (!wb_epochs.empty() && wb_epochs.front().closed)) {
+        wb_work.notify_one();
+        wb_done.wait(guard);
+    }
+    int ret = wb_error ? -1 : 0;
+    wb_error = false;
+    return ret;
+}
+
+// the flusher thread: writes the oldest epoch in block order, runs of
+// adjacent blocks with one pwritev() each, and syncs after closed epochs
+void
+Disk::flush_loop()
+{
+    std::unique_lock<std::mutex> guard(wb_lock);
+    for (;;) {
+        while (!wb_stop && (wb_epochs.empty() ||
+               (wb_epochs.front().blocks.empty() && !wb_epochs.front().closed)))
+            wb_work.wait(guard);
+        if (wb_epochs.empty() || (wb_epochs.front().blocks.empty() && !wb_epochs.front().closed))
+            break; // stopping with nothing left to write
+        wb_inflight.swap(wb_epochs.front().blocks);
+        bool closed = wb_epochs.front().closed;
+        if (closed)
+            wb_epochs.pop_front();
+        wb_busy = true;
+        guard.unlock();
+
+        std::vector<unsigned> block_nos;
+        std::vector<uint8_t*> bufs;
+        for (std::map<unsigned, std::vector<uint8_t> >::iterator it = wb_inflight.begin(); it != wb_inflight.end(); ++it) {
+            block_nos.push_back(it->first);
+            bufs.push_back(&it->second[0]);
+        }
+        int ret = transfer_blocks(block_nos, bufs, true);
+        if (closed && fdatasync(fd))
+            ret = -1;
+
+        guard.lock();
+        if (ret)
+            wb_error = true;
+        wb_queued -= wb_inflight.size();
+        wb_inflight.clear();
+        wb_busy = false;
+        wb_done.notify_all();
+    }
+}
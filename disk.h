@@ -1,29 +1,121 @@
 #include <iostream>
-#include <fstream>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
 #define BLOCK_SIZE 4096
+#define DISK_BLOCKS 2048 // size of a new disk file (8 MB)
 #define DEBUG false
 
+// disk backends, selected when the Disk is constructed
+#define DISK_MODE_FILE 0 // pread/pwrite on the disk file
+#define DISK_MODE_MMAP 1 // the whole disk file is memory mapped
+
+// most blocks queued for the write-behind thread before writers wait
+#define WB_QUEUE_BLOCKS 1024
+
+// I/O counters, counted when blocks are handed to the Disk
+struct disk_stats {
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t flushes;
+    uint64_t syncs;
+    uint64_t barriers;
+};
+
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    // the disk file is accessed through a raw descriptor with pread/pwrite,
+    // or through map when the disk is memory mapped
+    int fd;
+    int mode;
+    uint8_t *map;
+    // mapped blocks written since the last msync(), only they are synced
+    std::set<unsigned> map_dirty;
+    // the size of an existing disk file is kept, new files get DISK_BLOCKS
+    unsigned no_blocks;
+    uint64_t disk_size;
+    // the disk file, DISKNAME unless the constructor got another name
+    std::string name;
+    disk_stats stats;
     bool disk_file_exists (const std::string& name);
+    int map_disk();
+    int sync_map(int flags);
+    int transfer_blocks(const std::vector<unsigned>& block_nos,
+                        const std::vector<uint8_t*>& bufs, bool do_write);
+
+    // write-behind: writes are copied into a queue of epochs that the
+    // flusher thread writes out in order, each epoch in block order with
+    // coalesced pwritev() calls. A barrier ends the current epoch.
+    struct wb_epoch {
+        std::map<unsigned, std::vector<uint8_t> > blocks;
+        bool closed;
+        wb_epoch() : closed(false) {}
+    };
+    bool write_behind;
+    std::thread flusher;
+    std::mutex wb_lock;
+    std::condition_variable wb_work; // signals the flusher
+    std::condition_variable wb_done; // signals writers waiting for room or a drain
+    std::deque<wb_epoch> wb_epochs;
+    // blocks taken by the flusher and not yet written, still readable
+    std::map<unsigned, std::vector<uint8_t> > wb_inflight;
+    unsigned wb_queued;
+    bool wb_busy;
+    bool wb_stop;
+    bool wb_error;
+    void flush_loop();
+    int queue_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs);
+    bool queued_block(unsigned block_no, uint8_t *blk);
+    int drain();
 public:
-    Disk();
+    Disk(int mode = DISK_MODE_FILE, const std::string& name = DISKNAME);
     ~Disk();
+    int get_mode() { return mode; }
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
+    const disk_stats& get_stats() { return stats; }
+    void reset_stats();
+    // changes the size of the disk file to <no_blocks> blocks
+    int resize(unsigned no_blocks);
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads the blocks <block_nos> into <bufs> (one buffer per block),
+    // adjacent blocks are read with a single preadv() call
+    int read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs);
+    // writes <bufs> to the blocks <block_nos> (one buffer per block),
+    // adjacent blocks are written with a single pwritev() call
+    int write_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs);
+    // hints that the blocks <block_nos> will be read soon, the host reads
+    // them in the background
+    void prefetch(const std::vector<unsigned>& block_nos);
+    // flushes written blocks to the disk file
+    int flush();
+    // waits until all written blocks are durable on the host disk
+    int sync();
+    // turns write-behind on or off, writes then return once the blocks
+    // are queued and a background thread writes them to the disk file.
+    // Only for DISK_MODE_FILE, returns -1 otherwise
+    int set_write_behind(bool on);
+    bool get_write_behind() { return write_behind; }
+    // orders writes: the blocks written before the barrier reach the disk
+    // file, and are synced, before any block written after it. Without
+    // write-behind this waits for the sync, with it the flusher does.
+    int barrier();
 };
 
 #endif // __DISK_H__
@@ -1,101 +1,1279 @@
 #include <iostream>
+#include <algorithm>
+#include <climits>
 #include <cstring>
 #include <sstream>
 #include <vector>
 #include "fs.h"
 
-FS::FS()
+FS::FS(int disk_mode, const std::string& disk_name) : disk(disk_mode, disk_name), cache(disk)
 {
     std::cout << "FS::FS()... Creating file system\n";
     current_dir_block = ROOT_BLOCK;
+    sync_interval = 1;
+    commands_since_sync = 0;
+    command_depth = 0;
+    chain_gen = 0;
+    journal_seq = 0;
+    journal_pos = 0;
+    journal_open = false;
+    sb_dirty = false;
+    formatted = false;
+    track_fresh = true;
+    std::memset(&stats, 0, sizeof(stats));
+    in_transaction = false;
+    tx_dir_block = ROOT_BLOCK;
+    // a directory block changed in the cache must not reach its place on
+    // the disk before its transaction is in the journal
+    cache.set_hold([this](unsigned block_no) { return is_logged_block(block_no); });
+    mount();
 }
 
 FS::~FS()
 {
+    // an unfinished transaction never reaches the disk
+    if (in_transaction) {
+        abort();
+    }
+    writeback();
+    // nothing is left to redo at the next mount
+    if (journal_pos > 0) {
+        checkpoint();
+    }
+}
+
+// Helper function: Called when a command_scope ends, syncs the cache
+// once sync_interval commands have completed
+void
+FS::end_command()
+{
+    if (--command_depth > 0)
+        return;
+    // a group of commands is committed early, before its metadata
+    // outgrows the journal
+    if (++commands_since_sync >= sync_interval || logged_dirty() * 2 > journal_capacity())
+        writeback();
+}
 
+// Helper function: Write the FAT and all dirty cached blocks to the disk.
+// File data and new directory blocks are written in place, then the changed
+// metadata (superblock, FAT, refcounts and directories) is appended to the
+// journal. The metadata only reaches its place at the next checkpoint, when
+// the journal is full, and nothing waits for the host disk until then or
+// until sync(). New directory blocks must be on the disk before the
+// transaction pointing at them, that costs a barrier. A crash leaves either
+// the old or the new metadata, never a mix. All commands since the last
+// writeback commit together, the sync interval sets how many.
+int
+FS::writeback()
+{
+    commands_since_sync = 0;
+    write_fat();
+    std::function<bool(unsigned)> is_data = [this](unsigned block_no) {
+        return !is_logged_block(block_no);
+    };
+    std::function<bool(unsigned)> is_logged = [this](unsigned block_no) {
+        return is_logged_block(block_no);
+    };
+    int ret = cache.write_back(is_data);
+    unsigned count = cache.count_dirty(is_logged);
+    if (count > 0) {
+        for (std::unordered_set<uint32_t>::iterator it = fresh_blocks.begin(); it != fresh_blocks.end(); ++it) {
+            if (is_meta_block(*it)) {
+                if (disk.barrier()) {
+                    ret = -1;
+                }
+                close_journal();
+                break;
+            }
+        }
+        // copies of freed blocks in the journal must not be redone over
+        // their next use
+        std::vector<unsigned> revoked;
+        for (std::unordered_set<uint32_t>::iterator it = freed_blocks.begin(); it != freed_blocks.end(); ++it) {
+            if (chain_blocks.count(*it) != 0) {
+                revoked.push_back(*it);
+            }
+        }
+        std::vector<unsigned> block_nos;
+        std::vector<uint8_t*> bufs;
+        if (count <= journal_capacity()) {
+            cache.dirty_blocks(is_logged, block_nos, bufs);
+            if (!journal_fits(block_nos, revoked)) {
+                // the journal is full
+                if (checkpoint() < 0) {
+                    ret = -1;
+                }
+                revoked.clear();
+            }
+            if (log_blocks(block_nos, bufs, revoked) != 0) {
+                ret = -1;
+            }
+            cache.set_logged(block_nos);
+            unsynced_frees.insert(freed_blocks.begin(), freed_blocks.end());
+            // a format is on the disk before the blocks of the old file
+            // system are used again
+            if (!track_fresh) {
+                if (disk.barrier()) {
+                    ret = -1;
+                }
+                close_journal();
+            }
+        } else {
+            // too big for the journal. It is emptied first, its
+            // transactions must not be redone over these blocks at the next
+            // mount. Then the new blocks are allocated on the disk before
+            // the directories point at them, and the freed ones are only
+            // freed after no directory points at them any more. A crash in
+            // between leaks blocks but never frees one that is in use.
+            std::function<bool(unsigned)> is_dir = [this](unsigned block_no) {
+                return block_no == ROOT_BLOCK || (block_no >= sb.data_start && is_logged_block(block_no));
+            };
+            if ((journal_pos > 0 && checkpoint() < 0) || write_allocations() ||
+                disk.barrier() || cache.write_back(is_dir) || disk.barrier() ||
+                cache.write_back(is_logged) || disk.barrier()) {
+                ret = -1;
+            }
+            close_journal();
+        }
+    }
+    // the disk is up to date, blocks allocated from now on are fresh
+    fresh_blocks.clear();
+    freed_blocks.clear();
+    track_fresh = true;
+    return ret;
 }
 
-// Helper function: Read FAT from disk into memory
+// Helper function: Write the superblock, FAT and refcount blocks in place
+// with the blocks allocated since the last writeback in use, but without
+// the frees: a freed block keeps its FAT entry from the disk and a shared
+// one its larger count. Only the cache has the final blocks.
+int
+FS::write_allocations()
+{
+    std::function<bool(unsigned)> is_fat = [this](unsigned block_no) {
+        return block_no != ROOT_BLOCK && block_no < sb.data_start;
+    };
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> bufs;
+    cache.dirty_blocks(is_fat, block_nos, bufs);
+    // entries past the old used_blocks may be left over on the disk
+    uint8_t block[BLOCK_SIZE];
+    if (disk.read(SUPER_BLOCK, block) != 0) {
+        return -1;
+    }
+    uint32_t used_blocks = std::min(((superblock*)block)->used_blocks, sb.used_blocks);
+    std::vector<uint8_t> merged(block_nos.size() * BLOCK_SIZE);
+    std::vector<uint8_t*> merged_bufs;
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        uint8_t* buf = &merged[i * BLOCK_SIZE];
+        std::memcpy(buf, bufs[i], BLOCK_SIZE);
+        merged_bufs.push_back(buf);
+        if (block_nos[i] == SUPER_BLOCK) {
+            continue;
+        }
+        if (disk.read(block_nos[i], block) != 0) {
+            return -1;
+        }
+        if (block_nos[i] < sb.ref_start) {
+            uint32_t first = (block_nos[i] - sb.fat_start) * FAT_PAGE_ENTRIES;
+            int32_t* entries = (int32_t*)buf;
+            int32_t* old_entries = (int32_t*)block;
+            for (uint32_t j = 0; j < (uint32_t)FAT_PAGE_ENTRIES && first + j < used_blocks; j++) {
+                if (entries[j] == FAT_FREE) {
+                    entries[j] = old_entries[j];
+                }
+            }
+        } else {
+            uint32_t first = (block_nos[i] - sb.ref_start) * REF_PAGE_ENTRIES;
+            for (uint32_t j = 0; j < (uint32_t)REF_PAGE_ENTRIES && first + j < used_blocks; j++) {
+                buf[j] = std::max(buf[j], block[j]);
+            }
+        }
+    }
+    return disk.write_blocks(block_nos, merged_bufs);
+}
+
+// Helper function: Tell if a block holds metadata, i.e. the superblock,
+// the FAT, the refcounts or a directory. Those go through the journal.
+bool
+FS::is_meta_block(unsigned block_no)
+{
+    return block_no < sb.data_start || dir_blocks.count(block_no) != 0;
+}
+
+// Helper function: Tell if a block goes through the journal, i.e. it is
+// metadata that the file system on the disk already uses
+bool
+FS::is_logged_block(unsigned block_no)
+{
+    return is_meta_block(block_no) && fresh_blocks.count(block_no) == 0;
+}
+
+// Helper function: Most blocks one journal transaction can hold
+unsigned
+FS::journal_capacity()
+{
+    return std::min(sb.journal_blocks - 1, (uint32_t)JOURNAL_LIST / 2);
+}
+
+// Helper function: Count the blocks the next writeback logs, FAT and
+// refcount pages are counted before they are copied to the cache
+unsigned
+FS::logged_dirty()
+{
+    unsigned n = sb_dirty ? 1 : 0;
+    n += std::count(fat_page_dirty.begin(), fat_page_dirty.end(), true);
+    n += std::count(ref_page_dirty.begin(), ref_page_dirty.end(), true);
+    return n + cache.count_dirty([this](unsigned block_no) { return is_logged_block(block_no); });
+}
+
+// Helper function: Invalidate the first transaction in the journal, so
+// none is redone at the next mount
+int
+FS::clear_journal()
+{
+    std::vector<uint8_t> block(BLOCK_SIZE, 0);
+    return disk.write(sb.journal_start, &block[0]);
+}
+
+// Helper function: FNV-1a over 32-bit words, taken 64 bits at a time and
+// folded to 32 bits
+static uint32_t
+fnv_words(uint64_t h, const uint32_t* words, size_t n)
+{
+    const uint64_t prime = 1099511628211ull;
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        h = (h ^ (words[i] | (uint64_t)words[i + 1] << 32)) * prime;
+    }
+    if (n % 2 != 0) {
+        h = (h ^ words[n - 1]) * prime;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+// Helper function: Checksum of a journal header, its fields and list
+static uint32_t
+header_checksum(const journal_header* header)
+{
+    uint32_t fields[3] = { header->seq, header->count, header->revoked };
+    uint64_t h = fnv_words(14695981039346656037ull, fields, 3);
+    return fnv_words(h, header->blocks, 2 * (size_t)header->count + header->revoked);
+}
+
+// Helper function: Checksum of a block logged in the journal
+static uint32_t
+block_checksum(const uint8_t* block)
+{
+    return fnv_words(14695981039346656037ull, (const uint32_t*)block, BLOCK_SIZE / sizeof(uint32_t));
+}
+
+// Helper function: The journal is on the disk after a barrier, what is
+// logged next starts a new transaction
 void
-FS::read_fat()
+FS::close_journal()
+{
+    journal_open = false;
+    unsynced_frees.clear();
+}
+
+// Helper function: Tell if <block_nos> and <revoked> can be logged without
+// a checkpoint. They go into the open transaction if it has room and none
+// of them is revoked after it logged it, else into a new one after it.
+bool
+FS::journal_fits(const std::vector<unsigned>& block_nos, const std::vector<unsigned>& revoked)
+{
+    if (journal_open) {
+        // the copies of the open transaction follow its header
+        bool absorb = true;
+        for (size_t i = 0; i < revoked.size(); i++) {
+            if (chain_blocks[revoked[i]] > open_tx.pos) {
+                absorb = false;
+            }
+        }
+        uint32_t count = open_tx.blocks.size();
+        for (size_t i = 0; i < block_nos.size(); i++) {
+            std::map<uint32_t, uint32_t>::iterator it = chain_blocks.find(block_nos[i]);
+            if (it == chain_blocks.end() || it->second <= open_tx.pos) {
+                count++;
+            }
+        }
+        if (absorb && open_tx.pos + 1 + count <= sb.journal_blocks &&
+            2 * count + open_tx.revoked.size() + revoked.size() <= JOURNAL_LIST) {
+            return true;
+        }
+        journal_open = false;
+    }
+    return journal_pos + 1 + block_nos.size() <= sb.journal_blocks &&
+           2 * block_nos.size() + revoked.size() <= JOURNAL_LIST;
+}
+
+// Helper function: Log the blocks <block_nos> in the journal and revoke
+// <revoked>, journal_fits() tells if they fit. The open transaction takes
+// them: a block it logged already gets its new copy in the same place, the
+// others are appended, and its header is written again. The checksums tell
+// a torn transaction, so the header needs no barrier before it. The journal
+// is written directly, it never goes through the cache.
+int
+FS::log_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs,
+               const std::vector<unsigned>& revoked)
+{
+    if (!journal_open) {
+        journal_open = true;
+        open_tx.pos = journal_pos;
+        open_tx.seq = ++journal_seq;
+        open_tx.blocks.clear();
+        open_tx.sums.clear();
+        open_tx.revoked.clear();
+    }
+    // journal block -> what is written there, in disk order
+    std::map<unsigned, uint8_t*> writes;
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        uint32_t slot;
+        std::map<uint32_t, uint32_t>::iterator it = chain_blocks.find(block_nos[i]);
+        if (it != chain_blocks.end() && it->second > open_tx.pos) {
+            slot = it->second - open_tx.pos - 1;
+        } else {
+            slot = open_tx.blocks.size();
+            open_tx.blocks.push_back(block_nos[i]);
+            open_tx.sums.push_back(0);
+        }
+        open_tx.sums[slot] = block_checksum(bufs[i]);
+        chain_blocks[block_nos[i]] = open_tx.pos + 1 + slot;
+        writes[sb.journal_start + open_tx.pos + 1 + slot] = bufs[i];
+    }
+    for (size_t i = 0; i < revoked.size(); i++) {
+        open_tx.revoked.push_back(revoked[i]);
+        chain_blocks.erase(revoked[i]);
+    }
+    std::vector<uint8_t> block(BLOCK_SIZE, 0);
+    journal_header* header = (journal_header*)&block[0];
+    header->magic = JOURNAL_MAGIC;
+    header->seq = open_tx.seq;
+    header->count = open_tx.blocks.size();
+    header->revoked = open_tx.revoked.size();
+    std::copy(open_tx.blocks.begin(), open_tx.blocks.end(), header->blocks);
+    std::copy(open_tx.sums.begin(), open_tx.sums.end(), header->blocks + header->count);
+    std::copy(open_tx.revoked.begin(), open_tx.revoked.end(), header->blocks + 2 * header->count);
+    header->checksum = header_checksum(header);
+    writes[sb.journal_start + open_tx.pos] = &block[0];
+    stats.journal_commits++;
+    stats.journal_blocks += block_nos.size();
+    journal_pos = open_tx.pos + 1 + header->count;
+    std::vector<unsigned> log_nos;
+    std::vector<uint8_t*> log_bufs;
+    for (std::map<unsigned, uint8_t*>::iterator it = writes.begin(); it != writes.end(); ++it) {
+        log_nos.push_back(it->first);
+        log_bufs.push_back(it->second);
+    }
+    return disk.write_blocks(log_nos, log_bufs);
+}
+
+// Helper function: Write the committed transactions in the journal to
+// their places and empty it. The newest copy of a block is taken from the
+// cache, unless the block changed again since it was logged. At mount the
+// journal is read from the disk, after a crash its transactions are redone
+// up to the first one that didn't reach the disk whole.
+// Returns the number of blocks written in place, -1 on errors
+int
+FS::checkpoint()
+{
+    std::vector<uint8_t> copies;
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> bufs;
+    if (journal_pos > 0) {
+        copies.resize(chain_blocks.size() * BLOCK_SIZE);
+        std::map<uint32_t, uint32_t>::iterator it;
+        for (it = chain_blocks.begin(); it != chain_blocks.end(); ++it) {
+            uint8_t* buf = &copies[block_nos.size() * BLOCK_SIZE];
+            if (cache.read_logged(it->first, buf) != 0 &&
+                disk.read(sb.journal_start + it->second, buf) != 0) {
+                return -1;
+            }
+            block_nos.push_back(it->first);
+            bufs.push_back(buf);
+        }
+    } else if (read_journal(copies, block_nos, bufs) != 0) {
+        return -1;
+    }
+    journal_pos = 0;
+    chain_blocks.clear();
+    close_journal();
+    if (block_nos.empty()) {
+        return 0;
+    }
+    // the journal is on the disk before its blocks are overwritten in
+    // place, and they are before the journal is emptied
+    if (disk.barrier() || disk.write_blocks(block_nos, bufs) || disk.barrier()) {
+        return -1;
+    }
+    for (size_t i = 0; i < block_nos.size(); i++) {
+        cache.refresh(block_nos[i], bufs[i]);
+    }
+    cache.clear_logged();
+    stats.checkpoints++;
+    if (clear_journal()) {
+        return -1;
+    }
+    return block_nos.size();
+}
+
+// Helper function: Read the committed transactions in the journal, as a
+// crash left it. <bufs> get the newest copy of each block in <block_nos>,
+// they point into <journal>.
+// Returns -1 on read errors, 0 on success
+int
+FS::read_journal(std::vector<uint8_t>& journal, std::vector<unsigned>& block_nos,
+                 std::vector<uint8_t*>& bufs)
+{
+    uint32_t n = sb.journal_blocks;
+    journal.resize((size_t)n * BLOCK_SIZE);
+    std::vector<unsigned> log_nos;
+    std::vector<uint8_t*> log_bufs;
+    for (uint32_t i = 0; i < n; i++) {
+        log_nos.push_back(sb.journal_start + i);
+        log_bufs.push_back(&journal[(size_t)i * BLOCK_SIZE]);
+    }
+    if (disk.read_blocks(log_nos, log_bufs) != 0) {
+        return -1;
+    }
+    // freed blocks are dropped
+    std::map<unsigned, uint8_t*> latest;
+    uint32_t pos = 0;
+    uint32_t seq = 0;
+    while (pos < n) {
+        journal_header* header = (journal_header*)log_bufs[pos];
+        if (header->magic != JOURNAL_MAGIC || (pos > 0 && header->seq != seq + 1) ||
+            2 * (uint64_t)header->count + header->revoked > (uint64_t)JOURNAL_LIST ||
+            header->count >= n - pos || header_checksum(header) != header->checksum) {
+            break;
+        }
+        uint32_t* sums = header->blocks + header->count;
+        uint32_t* freed = header->blocks + 2 * header->count;
+        bool valid = true;
+        for (uint32_t i = 0; i < header->count + header->revoked; i++) {
+            uint32_t block_no = i < header->count ? header->blocks[i] : freed[i - header->count];
+            if (block_no >= sb.no_blocks || (block_no >= sb.journal_start && block_no < sb.data_start)) {
+                valid = false;
+            }
+        }
+        for (uint32_t i = 0; valid && i < header->count; i++) {
+            valid = block_checksum(log_bufs[pos + 1 + i]) == sums[i];
+        }
+        if (!valid) {
+            // torn transaction, it was never committed
+            break;
+        }
+        // a block freed and then logged again by the transaction is redone
+        for (uint32_t i = 0; i < header->revoked; i++) {
+            latest.erase(freed[i]);
+        }
+        for (uint32_t i = 0; i < header->count; i++) {
+            latest[header->blocks[i]] = log_bufs[pos + 1 + i];
+        }
+        seq = header->seq;
+        pos += 1 + header->count;
+    }
+    // left-over headers must not continue the transactions written next
+    for (uint32_t i = 0; i < n; i++) {
+        journal_header* header = (journal_header*)log_bufs[i];
+        if (header->magic == JOURNAL_MAGIC && header->seq > journal_seq) {
+            journal_seq = header->seq;
+        }
+    }
+    for (std::map<unsigned, uint8_t*>::iterator it = latest.begin(); it != latest.end(); ++it) {
+        block_nos.push_back(it->first);
+        bufs.push_back(it->second);
+    }
+    return 0;
+}
+
+// Helper function: Tell if a block holds only zeros
+static bool
+is_zero_block(const uint8_t* block)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (block[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function: Size of the journal for a disk of no_blocks blocks
+static uint32_t
+journal_size(unsigned no_blocks)
+{
+    return std::min(std::max(no_blocks / 32, (unsigned)JOURNAL_MIN_BLOCKS),
+                    (unsigned)JOURNAL_MAX_BLOCKS);
+}
+
+// Helper function: Mount the file system, reads the superblock and the
+// part of the FAT that is in use, and rebuilds the free-block bitmap.
+// Reference counts are paged in when they are needed. The committed
+// transactions in the journal are written in place first.
+void
+FS::mount()
 {
     uint8_t block[BLOCK_SIZE];
-    disk.read(FAT_BLOCK, block);
-    std::memcpy(fat, block, BLOCK_SIZE);
+    // what the journal holds is read from the disk
+    journal_pos = 0;
+    chain_blocks.clear();
+    close_journal();
+    for (int pass = 0; pass < 2; pass++) {
+        cache.read(SUPER_BLOCK, block);
+        std::memcpy(&sb, block, sizeof(sb));
+        sb_dirty = false;
+        formatted = true;
+        if (sb.magic != FS_MAGIC || sb.block_size != BLOCK_SIZE ||
+            sb.fat_entry_bits != 32 || sb.fat_start != FAT_START ||
+            sb.no_blocks > disk.get_no_blocks() || sb.used_blocks > sb.no_blocks ||
+            sb.ref_start != FAT_START + sb.fat_blocks ||
+            sb.journal_start != sb.ref_start + sb.ref_blocks || sb.journal_blocks < 2 ||
+            sb.data_start != sb.journal_start + sb.journal_blocks ||
+            sb.data_start >= sb.no_blocks ||
+            (uint64_t)sb.fat_blocks * FAT_PAGE_ENTRIES < sb.no_blocks ||
+            (uint64_t)sb.ref_blocks * REF_PAGE_ENTRIES < sb.no_blocks) {
+            // not formatted, use an empty FAT covering the whole disk. A
+            // format may have been committed without reaching the superblock.
+            init_layout(disk.get_no_blocks());
+            sb_dirty = false;
+            // a new disk file is all zeros. Anything else is an image of
+            // another layout (e.g. the old 16-bit FAT), its root is not
+            // parsed and nothing is written over it until it is formatted.
+            uint8_t root[BLOCK_SIZE];
+            cache.read(ROOT_BLOCK, root);
+            formatted = is_zero_block(block) && is_zero_block(root);
+        }
+        // the journal may have changed the superblock too, read it again
+        // after the checkpoint
+        if (pass > 0 || checkpoint() <= 0) {
+            break;
+        }
+    }
+    fat_pages.assign(sb.fat_blocks, std::vector<int32_t>());
+    fat_page_dirty.assign(sb.fat_blocks, false);
+    ref_pages.assign(sb.ref_blocks, std::vector<uint8_t>());
+    ref_page_dirty.assign(sb.ref_blocks, false);
+    tail_blocks.clear();
+    skip_indexes.clear();
+    dcache.clear();
+    dir_indexes.clear();
+    dir_chains.clear();
+    dir_blocks.clear();
+    fresh_blocks.clear();
+    freed_blocks.clear();
+    track_fresh = true;
+    alloc.reset(sb.data_start, sb.no_blocks);
+    for (uint32_t i = sb.data_start; i < sb.used_blocks; i++) {
+        if (get_fat(i) != FAT_FREE) {
+            alloc.reserve(i);
+        }
+    }
+}
+
+// Helper function: Check that the disk holds a file system, an image of
+// another layout can only be formatted
+bool
+FS::check_formatted()
+{
+    if (!formatted) {
+        std::cout << "Error: The disk is not formatted, run format\n";
+        return false;
+    }
+    return true;
+}
+
+// Helper function: Set up the superblock of an empty file system
+void
+FS::init_layout(unsigned no_blocks)
+{
+    std::memset(&sb, 0, sizeof(sb));
+    sb.magic = FS_MAGIC;
+    sb.block_size = BLOCK_SIZE;
+    sb.no_blocks = no_blocks;
+    sb.fat_start = FAT_START;
+    sb.fat_blocks = (no_blocks + FAT_PAGE_ENTRIES - 1) / FAT_PAGE_ENTRIES;
+    sb.fat_entry_bits = 32;
+    sb.ref_start = FAT_START + sb.fat_blocks;
+    sb.ref_blocks = (no_blocks + REF_PAGE_ENTRIES - 1) / REF_PAGE_ENTRIES;
+    sb.journal_start = sb.ref_start + sb.ref_blocks;
+    sb.journal_blocks = journal_size(no_blocks);
+    sb.data_start = sb.journal_start + sb.journal_blocks;
+    sb.used_blocks = 0;
+    sb_dirty = true;
+}
+
+// Helper function: Get a FAT page (the entries of one FAT block), it is
+// read from disk the first time it is used
+int32_t*
+FS::fat_page(unsigned page)
+{
+    std::vector<int32_t>& entries = fat_pages[page];
+    if (entries.empty()) {
+        entries.assign(FAT_PAGE_ENTRIES, FAT_FREE);
+        uint32_t first = page * FAT_PAGE_ENTRIES;
+        if (first < sb.used_blocks) {
+            cache.read(sb.fat_start + page, (uint8_t*)&entries[0]);
+            stats.fat_loads++;
+            // entries past used_blocks may be left over from an older
+            // file system, they are free
+            for (uint32_t i = sb.used_blocks - first; i < (uint32_t)FAT_PAGE_ENTRIES; i++) {
+                entries[i] = FAT_FREE;
+            }
+        }
+    }
+    return &entries[0];
 }
 
-// Helper function: Write FAT from memory to disk
+// Helper function: Get a page of reference counts, read from disk the
+// first time it is used like the FAT pages
+uint8_t*
+FS::ref_page(unsigned page)
+{
+    std::vector<uint8_t>& counts = ref_pages[page];
+    if (counts.empty()) {
+        counts.assign(REF_PAGE_ENTRIES, 0);
+        uint32_t first = page * REF_PAGE_ENTRIES;
+        if (first < sb.used_blocks) {
+            cache.read(sb.ref_start + page, &counts[0]);
+            stats.ref_loads++;
+            for (uint32_t i = sb.used_blocks - first; i < (uint32_t)REF_PAGE_ENTRIES; i++) {
+                counts[i] = 0;
+            }
+        }
+    }
+    return &counts[0];
+}
+
+// Helper function: Write the changed FAT pages, reference counts and the
+// superblock to disk
 void
 FS::write_fat()
 {
-    uint8_t block[BLOCK_SIZE];
-    std::memcpy(block, fat, BLOCK_SIZE);
-    disk.write(FAT_BLOCK, block);
+    for (unsigned i = 0; i < fat_page_dirty.size(); i++) {
+        if (fat_page_dirty[i]) {
+            cache.write(sb.fat_start + i, (uint8_t*)fat_page(i));
+            fat_page_dirty[i] = false;
+        }
+    }
+    for (unsigned i = 0; i < ref_page_dirty.size(); i++) {
+        if (ref_page_dirty[i]) {
+            cache.write(sb.ref_start + i, ref_page(i));
+            ref_page_dirty[i] = false;
+        }
+    }
+    if (sb_dirty) {
+        uint8_t block[BLOCK_SIZE];
+        std::memset(block, 0, BLOCK_SIZE);
+        std::memcpy(block, &sb, sizeof(sb));
+        cache.write(SUPER_BLOCK, block);
+        sb_dirty = false;
+    }
+}
+
+// Helper function: Read one FAT entry
+int32_t
+FS::get_fat(uint32_t idx)
+{
+    if (idx >= sb.no_blocks) {
+        return FAT_FREE;
+    }
+    return fat_page(idx / FAT_PAGE_ENTRIES)[idx % FAT_PAGE_ENTRIES];
+}
+
+// Helper function: Change one FAT entry and mark its page dirty
+void
+FS::set_fat(uint32_t idx, int32_t value)
+{
+    if (idx >= sb.no_blocks) {
+        return;
+    }
+    int32_t* entry = &fat_page(idx / FAT_PAGE_ENTRIES)[idx % FAT_PAGE_ENTRIES];
+    if (idx >= sb.data_start) {
+        if (value == FAT_FREE && *entry != FAT_FREE) {
+            if (fresh_blocks.erase(idx) == 0) {
+                freed_blocks.insert(idx);
+            }
+        } else if (value != FAT_FREE && *entry == FAT_FREE && track_fresh &&
+                   freed_blocks.count(idx) == 0 && unsynced_frees.count(idx) == 0) {
+            fresh_blocks.insert(idx);
+        }
+    }
+    // keep the free-block bitmap in step with the FAT
+    if (value == FAT_FREE) {
+        if (in_transaction) {
+            tx_freed.push_back(idx);
+        } else {
+            alloc.release(idx);
+        }
+    } else if (*entry == FAT_FREE) {
+        alloc.reserve(idx);
+        // the count of a free block may be left over from a removed or
+        // older file system, a new block has one owner
+        set_ref(idx, 0);
+    }
+    *entry = value;
+    fat_page_dirty[idx / FAT_PAGE_ENTRIES] = true;
+    if (value != FAT_FREE && idx >= sb.used_blocks) {
+        sb.used_blocks = idx + 1;
+        sb_dirty = true;
+    }
+}
+
+// Helper function: Read the number of extra files sharing a block
+unsigned
+FS::get_ref(uint32_t idx)
+{
+    if (idx >= sb.no_blocks) {
+        return 0;
+    }
+    return ref_page(idx / REF_PAGE_ENTRIES)[idx % REF_PAGE_ENTRIES];
+}
+
+// Helper function: Change the number of extra files sharing a block
+void
+FS::set_ref(uint32_t idx, unsigned value)
+{
+    if (idx >= sb.no_blocks) {
+        return;
+    }
+    uint8_t* count = &ref_page(idx / REF_PAGE_ENTRIES)[idx % REF_PAGE_ENTRIES];
+    if (*count != value) {
+        *count = value;
+        ref_page_dirty[idx / REF_PAGE_ENTRIES] = true;
+    }
+}
+
+// Helper function: Free all blocks in a FAT chain, blocks shared with
+// other files only lose one reference
+void
+FS::free_chain(int32_t first_block)
+{
+    tail_blocks.erase(first_block);
+    skip_indexes.erase(first_block);
+    chain_gen++;
+    int32_t current_block = first_block;
+    while (current_block != FAT_EOF && current_block != FAT_FREE) {
+        int32_t next_block = get_fat(current_block);
+        unsigned refs = get_ref(current_block);
+        if (refs > 0) {
+            set_ref(current_block, refs - 1);
+        } else {
+            set_fat(current_block, FAT_FREE);
+        }
+        current_block = next_block;
+    }
+}
+
+// Helper function: Add a reference to every block of a chain, so another
+// file can share it
+// Returns -1 if a block already has REF_MAX extra references, 0 on success
+int
+FS::share_chain(int32_t first_block)
+{
+    std::vector<uint32_t> blocks;
+    for (int32_t b = first_block; b != FAT_EOF && b != FAT_FREE; b = get_fat(b)) {
+        if (get_ref(b) >= REF_MAX) {
+            return -1;
+        }
+        blocks.push_back(b);
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        set_ref(blocks[i], get_ref(blocks[i]) + 1);
+    }
+    return 0;
+}
+
+// Helper function: Give a file its own copy of the shared blocks in its
+// chain before the file is written. The blocks after a shared block are
+// reached through its FAT entry, so they are shared as well: the chain
+// is copied from the first shared block to the end. first_block is
+// updated if the whole chain was copied
+// Returns -1 if the disk is full, 0 on success
+int
+FS::unshare_chain(int32_t& first_block)
+{
+    int32_t prev = FAT_EOF;
+    std::vector<uint32_t> shared;
+    for (int32_t b = first_block; b != FAT_EOF && b != FAT_FREE; b = get_fat(b)) {
+        if (shared.empty() && get_ref(b) == 0) {
+            prev = b;
+        } else {
+            shared.push_back(b);
+        }
+    }
+    if (shared.empty()) {
+        return 0;
+    }
+    
+    std::vector<uint32_t> blocks;
+    if (alloc.allocate(shared.size(), blocks, prev != FAT_EOF ? prev + 1 : 0) != 0) {
+        return -1;
+    }
+    link_chain(blocks);
+    
+    // Copy the shared blocks IO_BATCH blocks at a time
+    std::vector<uint8_t> buf(IO_BATCH * BLOCK_SIZE);
+    for (size_t i = 0; i < shared.size(); i += IO_BATCH) {
+        size_t n = std::min((size_t)IO_BATCH, shared.size() - i);
+        std::vector<unsigned> block_nos(shared.begin() + i, shared.begin() + i + n);
+        std::vector<uint8_t*> bufs;
+        for (size_t k = 0; k < n; k++) {
+            bufs.push_back(&buf[k * BLOCK_SIZE]);
+        }
+        cache.read_blocks(block_nos, bufs);
+        for (size_t k = 0; k < n; k++) {
+            cache.write(blocks[i + k], bufs[k]);
+        }
+    }
+    
+    // The other files keep the old blocks
+    for (size_t i = 0; i < shared.size(); i++) {
+        set_ref(shared[i], get_ref(shared[i]) - 1);
+    }
+    skip_indexes.erase(first_block);
+    if (prev == FAT_EOF) {
+        first_block = blocks[0];
+    } else {
+        set_fat(prev, blocks[0]);
+    }
+    tail_blocks[first_block] = blocks.back();
+    chain_gen++;
+    return 0;
+}
+
+// Helper function: Find the last block of a file. It is remembered by
+// first block, so appending to a file doesn't walk its whole chain.
+int32_t
+FS::get_tail(int32_t first_block)
+{
+    std::unordered_map<uint32_t, uint32_t>::iterator it = tail_blocks.find(first_block);
+    if (it != tail_blocks.end() && get_fat(it->second) == FAT_EOF) {
+        return it->second;
+    }
+    int32_t last_block = first_block;
+    while (get_fat(last_block) != FAT_EOF) {
+        last_block = get_fat(last_block);
+    }
+    tail_blocks[first_block] = last_block;
+    return last_block;
+}
+
+// Helper function: Get block <index> of the chain starting at first_block.
+// Every SKIP_STRIDE-th block is remembered as the chain is walked, so a
+// seek takes a lookup plus fewer than SKIP_STRIDE hops once the chain has
+// been walked that far.
+// Returns FAT_EOF if the chain is shorter
+int32_t
+FS::chain_block(int32_t first_block, uint32_t index)
+{
+    std::vector<uint32_t>& skip = skip_indexes[first_block];
+    if (skip.empty()) {
+        skip.push_back(first_block);
+    }
+    uint32_t i = std::min((size_t)(index / SKIP_STRIDE), skip.size() - 1) * SKIP_STRIDE;
+    int32_t block = skip[i / SKIP_STRIDE];
+    while (i < index) {
+        block = get_fat(block);
+        if (block == FAT_EOF || block == FAT_FREE) {
+            return FAT_EOF;
+        }
+        i++;
+        if (i % SKIP_STRIDE == 0 && i / SKIP_STRIDE == skip.size()) {
+            skip.push_back(block);
+        }
+    }
+    return block;
 }
 
-// Helper function: Find a free block in the FAT
-int16_t
-FS::find_free_block()
+// Helper function: Give a file its own copy of the blocks it shares with
+// other files, before it is written. The blocks after a shared block are
+// shared too, so the file shares blocks only if its last block is shared.
+// Returns -1 if the disk is full, 0 on success
+int
+FS::unshare_file(uint32_t dir_block, const std::string& name, dir_entry* entry)
+{
+    if (get_ref(get_tail(entry->first_blk)) == 0) {
+        return 0;
+    }
+    int32_t first_block = entry->first_blk;
+    if (unshare_chain(first_block) != 0) {
+        return -1;
+    }
+    if (first_block != (int32_t)entry->first_blk) {
+        entry->first_blk = first_block;
+        // the cached dentry still has the old first block
+        dcache.remove(dir_block, name);
+    }
+    return 0;
+}
+
+// Helper function: Change the size of a file that shares no blocks, blocks
+// are added or freed at the end. The bytes between the old and the new end
+// of the file are zeroed, so they read as zeros if the file grows again.
+// Returns -1 if the disk is full, 0 on success
+int
+FS::resize_file(dir_entry* entry, uint32_t new_size)
 {
-    for (int i = 2; i < BLOCK_SIZE/2; i++) {
-        if (fat[i] == FAT_FREE) {
-            return i;
+    uint32_t old_size = entry->size;
+    if (new_size == old_size) {
+        return 0;
+    }
+    // a file always has at least one block
+    uint32_t old_blocks = old_size ? (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+    uint32_t new_blocks = new_size ? (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+    int32_t last_block = get_tail(entry->first_blk);
+    // the block holding the end of the shorter file
+    int32_t end_block = last_block;
+    
+    if (new_blocks > old_blocks) {
+        std::vector<uint32_t> blocks;
+        if (alloc.allocate(new_blocks - old_blocks, blocks, last_block + 1) != 0) {
+            return -1;
+        }
+        uint8_t zero[BLOCK_SIZE];
+        std::memset(zero, 0, BLOCK_SIZE);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            cache.write(blocks[i], zero);
+        }
+        set_fat(last_block, link_chain(blocks));
+        tail_blocks[entry->first_blk] = blocks.back();
+    } else if (new_blocks < old_blocks) {
+        end_block = chain_block(entry->first_blk, new_blocks - 1);
+        int32_t rest = get_fat(end_block);
+        set_fat(end_block, FAT_EOF);
+        free_chain(rest);
+        tail_blocks[entry->first_blk] = end_block;
+        skip_indexes.erase(entry->first_blk);
+    }
+    
+    uint32_t end = std::min(old_size, new_size) % BLOCK_SIZE;
+    if (end > 0 || std::min(old_size, new_size) == 0) {
+        BlockRef ref = cache.get_block_mut(end_block);
+        if (ref.valid()) {
+            std::memset(ref.bytes() + end, 0, BLOCK_SIZE - end);
         }
     }
-    return -1;
+    entry->size = new_size;
+    return 0;
 }
 
-// Helper function: Find free directory entry index in a directory block
+// Helper function: Link allocated blocks into a FAT chain
+// Returns the first block of the chain
+int32_t
+FS::link_chain(const std::vector<uint32_t>& blocks)
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        set_fat(blocks[i], i + 1 < blocks.size() ? blocks[i + 1] : FAT_EOF);
+    }
+    return blocks[0];
+}
+
+// Helper function: Add one block to the end of a chain being written
+// Allocates a block right after last_block if possible, links it and
+// writes data to it. first_block is set for the first block of the chain
+// Returns -1 if the disk is full, 0 on success
 int
-FS::find_free_dir_entry(uint16_t dir_block)
+FS::append_block(int32_t& first_block, int32_t& last_block, uint8_t *data)
 {
-    dir_entry* entries = read_dir_entries(dir_block);
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) {
+    std::vector<uint32_t> blocks;
+    unsigned goal = last_block != FAT_EOF ? last_block + 1 : 0;
+    if (alloc.allocate(1, blocks, goal) != 0) {
+        return -1;
+    }
+    set_fat(blocks[0], FAT_EOF);
+    if (last_block != FAT_EOF) {
+        set_fat(last_block, blocks[0]);
+    } else {
+        first_block = blocks[0];
+    }
+    last_block = blocks[0];
+    cache.write(last_block, data);
+    return 0;
+}
+
+// Helper function: Read the next blocks of a FAT chain
+// Reads up to max_blocks blocks starting at block into buf with one
+// vectored read, count is set to the number of blocks read. The next
+// READAHEAD_BLOCKS blocks of the chain are prefetched meanwhile, so a
+// caller scanning the chain finds them already read.
+// Returns the block following the last block read (FAT_EOF at the end)
+int32_t
+FS::read_chain(int32_t block, unsigned max_blocks, uint8_t *buf, unsigned& count)
+{
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> bufs;
+    while (block != FAT_EOF && block != FAT_FREE && block_nos.size() < max_blocks) {
+        bufs.push_back(buf + block_nos.size() * BLOCK_SIZE);
+        block_nos.push_back(block);
+        block = get_fat(block);
+    }
+    count = block_nos.size();
+    std::vector<unsigned> ahead;
+    for (int32_t b = block; b != FAT_EOF && b != FAT_FREE && ahead.size() < READAHEAD_BLOCKS; b = get_fat(b)) {
+        ahead.push_back(b);
+    }
+    if (!ahead.empty()) {
+        cache.prefetch(ahead);
+    }
+    if (count > 0) {
+        cache.read_blocks(block_nos, bufs);
+    }
+    return block;
+}
+
+// Helper function: Read the first size bytes of a file into data
+void
+FS::read_file_data(int32_t first_blk, uint32_t size, std::string& data)
+{
+    unsigned blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint8_t> buf(blocks * BLOCK_SIZE);
+    unsigned count = 0;
+    if (blocks > 0) {
+        read_chain(first_blk, blocks, &buf[0], count);
+    }
+    data.assign((char*)buf.data(), std::min(size, (uint32_t)(count * BLOCK_SIZE)));
+}
+
+// Helper function: Hash a file name, selects the directory block (bucket)
+// that holds the entry. Stored on disk implicitly, don't change it.
+static uint32_t
+name_hash(const std::string& name)
+{
+    // 32-bit FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.length(); i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Helper function: Get the blocks of a directory, block i of the chain is
+// hash bucket i. Cached until the directory grows or is removed.
+const std::vector<uint32_t>&
+FS::get_dir_chain(uint32_t dir_block)
+{
+    std::map<uint32_t, std::vector<uint32_t> >::iterator it = dir_chains.find(dir_block);
+    if (it != dir_chains.end()) {
+        return it->second;
+    }
+    std::vector<uint32_t>& chain = dir_chains[dir_block];
+    int32_t block = dir_block;
+    do {
+        chain.push_back(block);
+        dir_blocks.insert(block);
+        block = get_fat(block);
+    } while (block != FAT_EOF && block != FAT_FREE && chain.size() < sb.no_blocks);
+    return chain;
+}
+
+// Helper function: Pin a directory block, counted in the stats
+BlockRef
+FS::get_dir_block(uint32_t block, bool mut)
+{
+    stats.dir_block_reads++;
+    return mut ? cache.get_block_mut(block) : cache.get_block(block);
+}
+
+// Helper function: Get the name index of a directory block, it is built
+// from the block the first time the block is used
+// Returns nullptr if the directory block can't be read
+DirIndex*
+FS::get_dir_index(uint32_t block)
+{
+    std::map<uint32_t, DirIndex>::iterator it = dir_indexes.find(block);
+    if (it != dir_indexes.end()) {
+        return &it->second;
+    }
+    BlockRef dir = get_dir_block(block);
+    if (!dir.valid()) {
+        return nullptr;
+    }
+    dir_entry* entries = dir.as<dir_entry>();
+    DirIndex& index = dir_indexes[block];
+    for (int i = 0; i < DIR_ENTRIES; i++) {
         if (entries[i].file_name[0] == '\0') {
-            delete[] entries;
-            return i;
+            index.add_free(i);
+        } else if (index.find(entries[i].file_name) == -1) {
+            index.add(entries[i].file_name, i);
         }
     }
-    delete[] entries;
-    return -1;
+    return &index;
 }
 
-// Helper function: Read directory entries from a block
+// Helper function: Pin the directory block holding entry idx
+// ref: output - keeps the block pinned while the entry is used
+// Returns the entry, or nullptr on error
 dir_entry*
-FS::read_dir_entries(uint16_t dir_block)
+FS::get_entry(uint32_t dir_block, int idx, BlockRef& ref, bool mut)
 {
-    uint8_t block[BLOCK_SIZE];
-    disk.read(dir_block, block);
-    
-    dir_entry* entries = new dir_entry[BLOCK_SIZE / sizeof(dir_entry)];
-    std::memcpy(entries, block, BLOCK_SIZE);
-    return entries;
+    const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+    if (idx < 0 || idx / DIR_ENTRIES >= (int)chain.size()) {
+        return nullptr;
+    }
+    uint32_t block = chain[idx / DIR_ENTRIES];
+    ref = get_dir_block(block, mut);
+    if (!ref.valid()) {
+        return nullptr;
+    }
+    return ref.as<dir_entry>() + idx % DIR_ENTRIES;
 }
 
-// Helper function: Write directory entries to a block
+// Helper function: Record that name was written to entry idx of a directory
 void
-FS::write_dir_entries(uint16_t dir_block, dir_entry* entries)
+FS::dir_entry_added(uint32_t dir_block, const std::string& name, int idx)
 {
-    uint8_t block[BLOCK_SIZE];
-    std::memcpy(block, entries, BLOCK_SIZE);
-    disk.write(dir_block, block);
+    const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+    DirIndex* index = get_dir_index(chain[idx / DIR_ENTRIES]);
+    if (index != nullptr) {
+        index->add(name, idx % DIR_ENTRIES);
+    }
+    dcache.remove(dir_block, name);
+}
+
+// Helper function: Record that entry idx, holding name, was cleared
+void
+FS::dir_entry_removed(uint32_t dir_block, const std::string& name, int idx)
+{
+    const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+    DirIndex* index = get_dir_index(chain[idx / DIR_ENTRIES]);
+    if (index != nullptr) {
+        index->remove(name);
+    }
+    dcache.remove(dir_block, name);
+}
+
+// Helper function: Forget everything cached about a directory, used when
+// it is removed, grows, or its block is reused for a new directory
+void
+FS::drop_dir(uint32_t dir_block)
+{
+    const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+    for (size_t i = 0; i < chain.size(); i++) {
+        dir_indexes.erase(chain[i]);
+        dir_blocks.erase(chain[i]);
+    }
+    dir_chains.erase(dir_block);
+    dcache.remove_dir(dir_block);
+}
+
+// Helper function: Double the number of blocks (hash buckets) of a
+// directory and rehash its entries. Each old bucket splits into two new
+// ones, so no bucket can overflow while rehashing.
+// Returns 0 on success, -1 if the disk is full
+int
+FS::grow_dir(uint32_t dir_block)
+{
+    std::vector<uint32_t> old_chain = get_dir_chain(dir_block);
+    unsigned old_buckets = old_chain.size();
+    unsigned buckets = old_buckets * 2;
+    
+    // Read the old buckets before anything changes (not with read_chain(),
+    // the root directory is block 0)
+    std::vector<uint8_t> old_data(old_buckets * BLOCK_SIZE);
+    std::vector<unsigned> block_nos(old_chain.begin(), old_chain.end());
+    std::vector<uint8_t*> bufs;
+    for (unsigned i = 0; i < old_buckets; i++) {
+        bufs.push_back(&old_data[i * BLOCK_SIZE]);
+    }
+    if (cache.read_blocks(block_nos, bufs) != 0) {
+        return -1;
+    }
+    
+    // Extend the chain, preferably right after its last block
+    std::vector<uint32_t> new_blocks;
+    if (alloc.allocate(old_buckets, new_blocks, old_chain.back() + 1) != 0) {
+        return -1;
+    }
+    set_fat(old_chain.back(), link_chain(new_blocks));
+    drop_dir(dir_block);
+    const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+    
+    // Rehash, entries keep their relative order within a bucket
+    std::vector<uint8_t> data(buckets * BLOCK_SIZE, 0);
+    std::vector<int> used(buckets, 0);
+    dir_entry* old_entries = (dir_entry*)&old_data[0];
+    for (unsigned i = 0; i < old_buckets * DIR_ENTRIES; i++) {
+        if (old_entries[i].file_name[0] == '\0') {
+            continue;
+        }
+        unsigned b = name_hash(old_entries[i].file_name) % buckets;
+        dir_entry* entries = (dir_entry*)&data[b * BLOCK_SIZE];
+        entries[used[b]++] = old_entries[i];
+    }
+    for (unsigned b = 0; b < buckets; b++) {
+        cache.write(chain[b], &data[b * BLOCK_SIZE]);
+    }
+    return 0;
+}
+
+// Helper function: Find a free entry for name in a directory, the
+// directory grows if the name's bucket is full
+// Returns entry index or -1 if the disk is full
+int
+FS::find_free_dir_entry(uint32_t dir_block, const std::string& name)
+{
+    while (true) {
+        const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+        unsigned bucket = name_hash(name) % chain.size();
+        DirIndex* index = get_dir_index(chain[bucket]);
+        if (index == nullptr) {
+            return -1;
+        }
+        int slot = index->first_free();
+        if (slot != -1) {
+            return bucket * DIR_ENTRIES + slot;
+        }
+        if (grow_dir(dir_block) != 0) {
+            return -1;
+        }
+    }
 }
 
 // Helper function: Find entry in a directory by name
 // Returns entry index or -1 if not found
 int
-FS::find_entry_in_dir(uint16_t dir_block, const std::string& name)
+FS::find_entry_in_dir(uint32_t dir_block, const std::string& name)
 {
-    dir_entry* entries = read_dir_entries(dir_block);
-    for (int i = 0; i < BLOCK_SIZE / (int)sizeof(dir_entry); i++) {
-        if (entries[i].file_name[0] != '\0' && 
-            std::strcmp(entries[i].file_name, name.c_str()) == 0) {
-            delete[] entries;
-            return i;
-        }
+    dentry d;
+    return lookup_entry(dir_block, name, d);
+}
+
+// Helper function: Look up a name in a directory, through the dentry cache.
+// Only the block of the name's hash bucket is searched.
+// d: output - index, first block and type of the entry (idx -1 if not found)
+// Returns entry index or -1 if not found
+int
+FS::lookup_entry(uint32_t dir_block, const std::string& name, dentry& d)
+{
+    if (dcache.lookup(dir_block, name, d)) {
+        return d.idx;
     }
-    delete[] entries;
-    return -1;
+    const std::vector<uint32_t>& chain = get_dir_chain(dir_block);
+    unsigned bucket = name_hash(name) % chain.size();
+    DirIndex* index = get_dir_index(chain[bucket]);
+    if (index == nullptr) {
+        return -1;
+    }
+    int slot = index->find(name);
+    d.idx = -1;
+    d.first_blk = 0;
+    d.type = 0;
+    if (slot != -1) {
+        BlockRef dir = get_dir_block(chain[bucket]);
+        if (!dir.valid()) {
+            return -1;
+        }
+        dir_entry* entries = dir.as<dir_entry>();
+        d.idx = bucket * DIR_ENTRIES + slot;
+        d.first_blk = entries[slot].first_blk;
+        d.type = entries[slot].type;
+    }
+    // names that do not exist are cached too
+    dcache.insert(dir_block, name, d);
+    return d.idx;
 }
 
 // Helper function: Resolve a path to directory block and target name
@@ -104,14 +1282,14 @@ FS::find_entry_in_dir(uint16_t dir_block, const std::string& name)
 // name: output - the name of the target (file or directory)
 // Returns 0 on success, -1 on error
 int
-FS::resolve_path(const std::string& path, uint16_t& dir_block, std::string& name)
+FS::resolve_path(const std::string& path, uint32_t& dir_block, std::string& name)
 {
     if (path.empty()) {
         return -1;
     }
     
     // Determine starting directory
-    uint16_t current = current_dir_block;
+    uint32_t current = current_dir_block;
     size_t start = 0;
     
     if (path[0] == '/') {
@@ -147,32 +1325,22 @@ FS::resolve_path(const std::string& path, uint16_t& dir_block, std::string& name
     // Navigate to the parent directory of the target
     for (size_t i = 0; i < components.size() - 1; i++) {
         const std::string& comp = components[i];
+        dentry d;
         
         if (comp == "..") {
-            // Go to parent
-            dir_entry* entries = read_dir_entries(current);
-            for (int j = 0; j < BLOCK_SIZE / (int)sizeof(dir_entry); j++) {
-                if (entries[j].file_name[0] != '\0' && 
-                    std::strcmp(entries[j].file_name, "..") == 0) {
-                    current = entries[j].first_blk;
-                    break;
-                }
+            // Go to parent, the root directory has no '..' and is its own parent
+            if (lookup_entry(current, comp, d) != -1) {
+                current = d.first_blk;
             }
-            delete[] entries;
         } else {
             // Find subdirectory
-            int idx = find_entry_in_dir(current, comp);
-            if (idx == -1) {
+            if (lookup_entry(current, comp, d) == -1) {
                 return -1; // Path component not found
             }
-            
-            dir_entry* entries = read_dir_entries(current);
-            if (entries[idx].type != TYPE_DIR) {
-                delete[] entries;
+            if (d.type != TYPE_DIR) {
                 return -1; // Not a directory
             }
-            current = entries[idx].first_blk;
-            delete[] entries;
+            current = d.first_blk;
         }
     }
     
@@ -181,31 +1349,76 @@ FS::resolve_path(const std::string& path, uint16_t& dir_block, std::string& name
     return 0;
 }
 
-// formats the disk, i.e., creates an empty file system
+// formats the disk, i.e., creates an empty file system.
+// no_blocks changes the size of the disk, 0 keeps the current size
 int
-FS::format()
+FS::format(unsigned no_blocks)
 {
-    // Initialize FAT: all entries are free
-    for (int i = 0; i < BLOCK_SIZE/2; i++) {
-        fat[i] = FAT_FREE;
+    if (in_transaction) {
+        return -1;
     }
+    command_scope scope(*this);
     
-    // Mark block 0 (root directory) as EOF
-    fat[ROOT_BLOCK] = FAT_EOF;
+    if (no_blocks == 0) {
+        no_blocks = disk.get_no_blocks();
+    }
+    if (no_blocks > FS_MAX_BLOCKS ||
+        no_blocks < FAT_START + (no_blocks + FAT_PAGE_ENTRIES - 1) / FAT_PAGE_ENTRIES +
+                    (no_blocks + REF_PAGE_ENTRIES - 1) / REF_PAGE_ENTRIES +
+                    journal_size(no_blocks) + 1) {
+        return -1;
+    }
+    // the journal is written in place first, the new file system may
+    // reuse the blocks it holds
+    writeback();
+    if (journal_pos > 0 && checkpoint() < 0) {
+        return -1;
+    }
+    if (no_blocks != disk.get_no_blocks()) {
+        // nothing cached survives the format
+        cache.invalidate();
+        if (disk.resize(no_blocks) != 0) {
+            return -1;
+        }
+    }
     
-    // Mark block 1 (FAT block) as EOF
-    fat[FAT_BLOCK] = FAT_EOF;
+    // Initialize FAT: all entries are free. Only the pages that get used
+    // are ever written.
+    init_layout(no_blocks);
+    fat_pages.assign(sb.fat_blocks, std::vector<int32_t>());
+    fat_page_dirty.assign(sb.fat_blocks, false);
+    ref_pages.assign(sb.ref_blocks, std::vector<uint8_t>());
+    ref_page_dirty.assign(sb.ref_blocks, false);
+    alloc.reset(sb.data_start, sb.no_blocks);
+    // the old file system stays on the disk until the format is written
+    // back, every block may still be in use there
+    fresh_blocks.clear();
+    freed_blocks.clear();
+    track_fresh = false;
     
-    // Write FAT to disk
-    write_fat();
+    // Mark block 0 (root directory) as EOF
+    set_fat(ROOT_BLOCK, FAT_EOF);
+    
+    // Mark the superblock, the FAT, the refcount and the journal blocks as EOF
+    for (uint32_t i = SUPER_BLOCK; i < sb.data_start; i++) {
+        set_fat(i, FAT_EOF);
+    }
     
     // Initialize root directory as empty
     uint8_t root_block[BLOCK_SIZE];
     std::memset(root_block, 0, BLOCK_SIZE);
-    disk.write(ROOT_BLOCK, root_block);
+    cache.write(ROOT_BLOCK, root_block);
     
-    // Set current directory to root
+    // Set current directory to root, open files are gone
+    formatted = true;
     current_dir_block = ROOT_BLOCK;
+    handles.clear();
+    tail_blocks.clear();
+    skip_indexes.clear();
+    dcache.clear();
+    dir_indexes.clear();
+    dir_chains.clear();
+    dir_blocks.clear();
     
     return 0;
 }
@@ -215,8 +1428,20 @@ FS::format()
 int
 FS::create(std::string filepath)
 {
+    return create(filepath, std::cin);
+}
+
+// create reading the data lines from <in>, e.g. a script already in memory
+int
+FS::create(std::string filepath, std::istream& in)
+{
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Resolve path
-    uint16_t dir_block;
+    uint32_t dir_block;
     std::string filename;
     if (resolve_path(filepath, dir_block, filename) != 0) {
         return -1;
@@ -233,87 +1458,76 @@ FS::create(std::string filepath)
     }
     
     // Find free directory entry
-    int free_entry_idx = find_free_dir_entry(dir_block);
+    int free_entry_idx = find_free_dir_entry(dir_block, filename);
     if (free_entry_idx == -1) {
         return -1;
     }
     
-    // Read user input until empty line
+    // Stream the input, until an empty line, through a one-block staging
+    // buffer. A block is allocated and written each time the buffer fills,
+    // so memory use does not depend on the file size.
+    uint8_t block[BLOCK_SIZE];
+    std::memset(block, 0, BLOCK_SIZE);
+    uint32_t fill = 0;
+    uint32_t data_size = 0;
+    int32_t first_block = FAT_EOF;
+    int32_t last_block = FAT_EOF;
+    bool disk_full = false;
     std::string line;
-    std::string data;
-    while (std::getline(std::cin, line)) {
+    while (std::getline(in, line)) {
         if (line.empty()) {
             break;
         }
-        data += line + "\n";
-    }
-    
-    uint32_t data_size = data.length();
-    
-    // Calculate number of blocks needed
-    int blocks_needed = (data_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (blocks_needed == 0) blocks_needed = 1; // At least one block even for empty file
-    
-    // Read FAT
-    read_fat();
-    
-    // Find and allocate blocks
-    int16_t first_block = -1;
-    int16_t prev_block = -1;
-    
-    for (int i = 0; i < blocks_needed; i++) {
-        int16_t free_block = find_free_block();
-        if (free_block == -1) {
-            return -1;
+        // Once the disk is full the rest of the input is only consumed
+        if (disk_full) {
+            continue;
         }
-        
-        if (first_block == -1) {
-            first_block = free_block;
-        }
-        
-        if (prev_block != -1) {
-            fat[prev_block] = free_block;
+        line += '\n';
+        size_t pos = 0;
+        while (pos < line.length()) {
+            // The buffer is written only when more data follows, so the
+            // last block is always written below
+            if (fill == BLOCK_SIZE) {
+                if (append_block(first_block, last_block, block) != 0) {
+                    disk_full = true;
+                    break;
+                }
+                std::memset(block, 0, BLOCK_SIZE);
+                fill = 0;
+            }
+            size_t n = std::min((size_t)(BLOCK_SIZE - fill), line.length() - pos);
+            std::memcpy(block + fill, line.data() + pos, n);
+            fill += n;
+            pos += n;
+            data_size += n;
         }
-        
-        fat[free_block] = FAT_EOF;
-        prev_block = free_block;
     }
     
-    // Write data to blocks
-    uint8_t block[BLOCK_SIZE];
-    int16_t current_block = first_block;
-    uint32_t offset = 0;
-    
-    while (current_block != FAT_EOF) {
-        std::memset(block, 0, BLOCK_SIZE);
-        
-        uint32_t bytes_to_write = std::min((uint32_t)BLOCK_SIZE, data_size - offset);
-        if (bytes_to_write > 0) {
-            std::memcpy(block, data.c_str() + offset, bytes_to_write);
+    // Write the last block, an empty file still gets one block
+    if (!disk_full && (fill > 0 || first_block == FAT_EOF)) {
+        disk_full = append_block(first_block, last_block, block) != 0;
+    }
+    if (disk_full) {
+        if (first_block != FAT_EOF) {
+            free_chain(first_block);
         }
-        
-        disk.write(current_block, block);
-        offset += bytes_to_write;
-        
-        int16_t next_block = fat[current_block];
-        current_block = next_block;
+        return -1;
     }
     
-    // Write FAT to disk
-    write_fat();
-    
-    // Read directory entries and create new entry
-    dir_entry* entries = read_dir_entries(dir_block);
-    std::strcpy(entries[free_entry_idx].file_name, filename.c_str());
-    entries[free_entry_idx].size = data_size;
-    entries[free_entry_idx].first_blk = first_block;
-    entries[free_entry_idx].type = TYPE_FILE;
-    entries[free_entry_idx].access_rights = READ | WRITE;
-    
-    // Write directory back to disk
-    write_dir_entries(dir_block, entries);
+    // Create the new directory entry
+    BlockRef entry_ref;
+    dir_entry* entry = get_entry(dir_block, free_entry_idx, entry_ref, true);
+    if (entry == nullptr) {
+        free_chain(first_block);
+        return -1;
+    }
+    std::strcpy(entry->file_name, filename.c_str());
+    entry->size = data_size;
+    entry->first_blk = first_block;
+    entry->type = TYPE_FILE;
+    entry->access_rights = READ | WRITE;
+    dir_entry_added(dir_block, filename, free_entry_idx);
     
-    delete[] entries;
     return 0;
 }
 
@@ -321,8 +1535,19 @@ FS::create(std::string filepath)
 int
 FS::cat(std::string filepath)
 {
+    return cat(filepath, std::cout);
+}
+
+// writes the content of a file to <out>, e.g. a std::ofstream to export
+// the file to the host
+int
+FS::cat(std::string filepath, std::ostream& out)
+{
+    if (!check_formatted()) {
+        return -1;
+    }
     // Resolve path
-    uint16_t dir_block;
+    uint32_t dir_block;
     std::string filename;
     if (resolve_path(filepath, dir_block, filename) != 0) {
         return -1;
@@ -339,43 +1564,48 @@ FS::cat(std::string filepath)
         return -1;
     }
     
-    // Read directory entries
-    dir_entry* entries = read_dir_entries(dir_block);
+    // Read the directory entry
+    BlockRef entry_ref;
+    dir_entry* entry = get_entry(dir_block, file_idx, entry_ref);
+    if (entry == nullptr) {
+        return -1;
+    }
     
     // Check if it's a directory
-    if (entries[file_idx].type == TYPE_DIR) {
-        delete[] entries;
+    if (entry->type == TYPE_DIR) {
         return -1; // Cannot cat a directory
     }
     
     // Check read permission
-    if (!(entries[file_idx].access_rights & READ)) {
+    if (!(entry->access_rights & READ)) {
         std::cout << "Error: No read permission\n";
-        delete[] entries;
         return -1;
     }
     
-    // Read FAT
-    read_fat();
-    
-    // Read and print file contents
-    uint8_t block[BLOCK_SIZE];
-    int16_t current_block = entries[file_idx].first_blk;
-    uint32_t bytes_remaining = entries[file_idx].size;
+    // Read and write out the file contents, IO_BATCH blocks at a time
+    // with one write per batch
+    std::vector<uint8_t> buf(IO_BATCH * BLOCK_SIZE);
+    int32_t current_block = entry->first_blk;
+    uint32_t bytes_remaining = entry->size;
+    entry_ref.release();
     
     while (current_block != FAT_EOF && bytes_remaining > 0) {
-        disk.read(current_block, block);
+        unsigned want = std::min((uint32_t)IO_BATCH, (bytes_remaining + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        unsigned count;
+        current_block = read_chain(current_block, want, &buf[0], count);
+        if (count == 0) {
+            break;
+        }
         
-        uint32_t bytes_to_print = std::min((uint32_t)BLOCK_SIZE, bytes_remaining);
-        for (uint32_t i = 0; i < bytes_to_print; i++) {
-            std::cout << (char)block[i];
+        uint32_t bytes_to_print = std::min((uint32_t)(count * BLOCK_SIZE), bytes_remaining);
+        out.write((const char*)&buf[0], bytes_to_print);
+        if (!out) {
+            return -1;
         }
         
         bytes_remaining -= bytes_to_print;
-        current_block = fat[current_block];
     }
     
-    delete[] entries;
     return 0;
 }
 
@@ -383,15 +1613,24 @@ FS::cat(std::string filepath)
 int
 FS::ls()
 {
-    // Read current directory
-    dir_entry* entries = read_dir_entries(current_dir_block);
-    
+    if (!check_formatted()) {
+        return -1;
+    }
     // Print header
     std::cout << "name\t type\t accessrights\t size\n";
     
-    // Print each file/directory
-    for (int i = 0; i < BLOCK_SIZE / (int)sizeof(dir_entry); i++) {
-        if (entries[i].file_name[0] != '\0') {
+    // Print each file/directory, block by block
+    std::vector<uint32_t> chain = get_dir_chain(current_dir_block);
+    for (size_t b = 0; b < chain.size(); b++) {
+        BlockRef entries_ref = get_dir_block(chain[b]);
+        if (!entries_ref.valid()) {
+            return -1;
+        }
+        dir_entry* entries = entries_ref.as<dir_entry>();
+        for (int i = 0; i < DIR_ENTRIES; i++) {
+            if (entries[i].file_name[0] == '\0') {
+                continue;
+            }
             std::cout << entries[i].file_name << "\t ";
             if (entries[i].type == TYPE_DIR) {
                 std::cout << "dir\t ";
@@ -413,17 +1652,21 @@ FS::ls()
         }
     }
     
-    delete[] entries;
     return 0;
 }
 
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
 int
-FS::cp(std::string sourcepath, std::string destpath)
+FS::cp(std::string sourcepath, std::string destpath, int reflink)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Resolve source path
-    uint16_t src_dir_block;
+    uint32_t src_dir_block;
     std::string src_name;
     if (resolve_path(sourcepath, src_dir_block, src_name) != 0 || src_name.empty()) {
         return -1;
@@ -435,34 +1678,35 @@ FS::cp(std::string sourcepath, std::string destpath)
         return -1;
     }
     
-    // Read source directory
-    dir_entry* src_entries = read_dir_entries(src_dir_block);
+    // Read the source entry, copied since a growing dest directory may
+    // move it
+    BlockRef src_ref;
+    dir_entry* src_entry = get_entry(src_dir_block, src_idx, src_ref);
+    if (src_entry == nullptr) {
+        return -1;
+    }
+    dir_entry src = *src_entry;
+    src_ref.release();
     
     // Check if source is a file (not a directory)
-    if (src_entries[src_idx].type != TYPE_FILE) {
-        delete[] src_entries;
+    if (src.type != TYPE_FILE) {
         return -1;
     }
     
     // Resolve dest path
-    uint16_t dest_dir_block;
+    uint32_t dest_dir_block;
     std::string dest_name;
     if (resolve_path(destpath, dest_dir_block, dest_name) != 0) {
-        delete[] src_entries;
         return -1;
     }
     
     // Check if dest_name is an existing directory - if so, copy INTO it with source filename
     if (!dest_name.empty()) {
-        int dest_idx = find_entry_in_dir(dest_dir_block, dest_name);
-        if (dest_idx != -1) {
-            dir_entry* check_entries = read_dir_entries(dest_dir_block);
-            if (check_entries[dest_idx].type == TYPE_DIR) {
-                // Dest is a directory, copy file into it with source name
-                dest_dir_block = check_entries[dest_idx].first_blk;
-                dest_name = src_name;
-            }
-            delete[] check_entries;
+        dentry d;
+        if (lookup_entry(dest_dir_block, dest_name, d) != -1 && d.type == TYPE_DIR) {
+            // Dest is a directory, copy file into it with source name
+            dest_dir_block = d.first_blk;
+            dest_name = src_name;
         }
     } else {
         // dest is "/" or similar - use source name
@@ -471,100 +1715,76 @@ FS::cp(std::string sourcepath, std::string destpath)
     
     // Check dest filename length
     if (dest_name.length() > 55) {
-        delete[] src_entries;
         return -1;
     }
     
     // Check if dest file already exists in target directory
     if (find_entry_in_dir(dest_dir_block, dest_name) != -1) {
-        delete[] src_entries;
         return -1; // Dest already exists (noclobber)
     }
     
     // Find free directory entry for dest
-    int dest_entry_idx = find_free_dir_entry(dest_dir_block);
+    int dest_entry_idx = find_free_dir_entry(dest_dir_block, dest_name);
     if (dest_entry_idx == -1) {
-        delete[] src_entries;
         return -1;
     }
     
-    // Read FAT
-    read_fat();
-    
-    // Read source file data
-    std::string data;
-    uint8_t block[BLOCK_SIZE];
-    int16_t current_block = src_entries[src_idx].first_blk;
-    uint32_t bytes_remaining = src_entries[src_idx].size;
-    
-    while (current_block != FAT_EOF && bytes_remaining > 0) {
-        disk.read(current_block, block);
-        uint32_t bytes_to_read = std::min((uint32_t)BLOCK_SIZE, bytes_remaining);
-        data.append((char*)block, bytes_to_read);
-        bytes_remaining -= bytes_to_read;
-        current_block = fat[current_block];
-    }
-    
-    delete[] src_entries;
-    
-    uint32_t data_size = data.length();
-    
-    // Calculate number of blocks needed
-    int blocks_needed = (data_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (blocks_needed == 0) blocks_needed = 1;
-    
-    // Allocate blocks for dest file
-    int16_t first_block = -1;
-    int16_t prev_block = -1;
-    
-    for (int i = 0; i < blocks_needed; i++) {
-        int16_t free_block = find_free_block();
-        if (free_block == -1) {
+    // Share the source blocks instead of copying them when possible,
+    // they are copied when one of the files is written
+    int32_t first_block = src.first_blk;
+    if (reflink == CP_REFLINK_NEVER || share_chain(src.first_blk) != 0) {
+        if (reflink == CP_REFLINK_ALWAYS) {
             return -1;
         }
         
-        if (first_block == -1) {
-            first_block = free_block;
-        }
-        
-        if (prev_block != -1) {
-            fat[prev_block] = free_block;
+        // Allocate all blocks for dest file in one call
+        unsigned blocks_needed = (src.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (blocks_needed == 0) blocks_needed = 1;
+        std::vector<uint32_t> blocks;
+        if (alloc.allocate(blocks_needed, blocks) != 0) {
+            return -1;
         }
+        first_block = link_chain(blocks);
         
-        fat[free_block] = FAT_EOF;
-        prev_block = free_block;
-    }
-    
-    // Write data to new blocks
-    current_block = first_block;
-    uint32_t offset = 0;
-    
-    while (current_block != FAT_EOF) {
-        std::memset(block, 0, BLOCK_SIZE);
-        uint32_t bytes_to_write = std::min((uint32_t)BLOCK_SIZE, data_size - offset);
-        if (bytes_to_write > 0) {
-            std::memcpy(block, data.c_str() + offset, bytes_to_write);
+        // Copy the data block by block through a reusable buffer of IO_BATCH
+        // blocks, the source chain is read with vectored reads
+        std::vector<uint8_t> buf(IO_BATCH * BLOCK_SIZE);
+        int32_t src_block = src.first_blk;
+        uint32_t left = src.size;
+        size_t i = 0;
+        while (i < blocks.size()) {
+            unsigned want = std::min((size_t)IO_BATCH, blocks.size() - i);
+            unsigned count = 0;
+            if (left > 0) {
+                src_block = read_chain(src_block, want, &buf[0], count);
+            }
+            // Zero what is not file data: the bytes past the end of the file
+            // and blocks missing from a short chain
+            size_t valid = std::min((size_t)left, (size_t)count * BLOCK_SIZE);
+            std::memset(&buf[valid], 0, want * BLOCK_SIZE - valid);
+            for (unsigned k = 0; k < want; k++) {
+                cache.write(blocks[i + k], &buf[k * BLOCK_SIZE]);
+            }
+            left -= std::min(left, (uint32_t)(want * BLOCK_SIZE));
+            i += want;
         }
-        disk.write(current_block, block);
-        offset += bytes_to_write;
-        current_block = fat[current_block];
     }
     
-    // Write FAT to disk
-    write_fat();
-    
     // Create directory entry for dest
-    dir_entry* dest_entries = read_dir_entries(dest_dir_block);
-    std::strcpy(dest_entries[dest_entry_idx].file_name, dest_name.c_str());
-    dest_entries[dest_entry_idx].size = data_size;
-    dest_entries[dest_entry_idx].first_blk = first_block;
-    dest_entries[dest_entry_idx].type = TYPE_FILE;
-    dest_entries[dest_entry_idx].access_rights = READ | WRITE;
-    
-    // Write directory back to disk
-    write_dir_entries(dest_dir_block, dest_entries);
+    BlockRef dest_ref;
+    dir_entry* dest_entry = get_entry(dest_dir_block, dest_entry_idx, dest_ref, true);
+    if (dest_entry == nullptr) {
+        // drops the copy, or the references taken on the shared blocks
+        free_chain(first_block);
+        return -1;
+    }
+    std::strcpy(dest_entry->file_name, dest_name.c_str());
+    dest_entry->size = src.size;
+    dest_entry->first_blk = first_block;
+    dest_entry->type = TYPE_FILE;
+    dest_entry->access_rights = READ | WRITE;
+    dir_entry_added(dest_dir_block, dest_name, dest_entry_idx);
     
-    delete[] dest_entries;
     return 0;
 }
 
@@ -573,8 +1793,13 @@ FS::cp(std::string sourcepath, std::string destpath)
 int
 FS::mv(std::string sourcepath, std::string destpath)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Resolve source path
-    uint16_t src_dir_block;
+    uint32_t src_dir_block;
     std::string src_name;
     if (resolve_path(sourcepath, src_dir_block, src_name) != 0 || src_name.empty()) {
         return -1;
@@ -586,34 +1811,35 @@ FS::mv(std::string sourcepath, std::string destpath)
         return -1;
     }
     
-    // Read source directory
-    dir_entry* src_entries = read_dir_entries(src_dir_block);
+    // Read the source entry, copied since a growing dest directory may
+    // move it
+    BlockRef src_ref;
+    dir_entry* src_entry = get_entry(src_dir_block, src_idx, src_ref);
+    if (src_entry == nullptr) {
+        return -1;
+    }
+    dir_entry src = *src_entry;
+    src_ref.release();
     
     // Check if source is a file (not a directory)
-    if (src_entries[src_idx].type != TYPE_FILE) {
-        delete[] src_entries;
+    if (src.type != TYPE_FILE) {
         return -1;
     }
     
     // Resolve dest path
-    uint16_t dest_dir_block;
+    uint32_t dest_dir_block;
     std::string dest_name;
     if (resolve_path(destpath, dest_dir_block, dest_name) != 0) {
-        delete[] src_entries;
         return -1;
     }
     
     // Check if dest_name is an existing directory - if so, move INTO it with source filename
     if (!dest_name.empty()) {
-        int dest_check_idx = find_entry_in_dir(dest_dir_block, dest_name);
-        if (dest_check_idx != -1) {
-            dir_entry* check_entries = read_dir_entries(dest_dir_block);
-            if (check_entries[dest_check_idx].type == TYPE_DIR) {
-                // Dest is a directory, move file into it with source name
-                dest_dir_block = check_entries[dest_check_idx].first_blk;
-                dest_name = src_name;
-            }
-            delete[] check_entries;
+        dentry d;
+        if (lookup_entry(dest_dir_block, dest_name, d) != -1 && d.type == TYPE_DIR) {
+            // Dest is a directory, move file into it with source name
+            dest_dir_block = d.first_blk;
+            dest_name = src_name;
         }
     } else {
         // dest is "/" or similar - use source name
@@ -622,44 +1848,65 @@ FS::mv(std::string sourcepath, std::string destpath)
     
     // Check dest filename length
     if (dest_name.length() > 55) {
-        delete[] src_entries;
         return -1;
     }
     
     // Check if dest file already exists in target directory
     if (find_entry_in_dir(dest_dir_block, dest_name) != -1) {
-        delete[] src_entries;
         return -1; // Dest already exists (noclobber)
     }
     
-    // If same directory, just rename
-    if (src_dir_block == dest_dir_block) {
-        std::strcpy(src_entries[src_idx].file_name, dest_name.c_str());
-        write_dir_entries(src_dir_block, src_entries);
-        delete[] src_entries;
+    // If the new name hashes to the same directory block, just rename
+    const std::vector<uint32_t>& chain = get_dir_chain(src_dir_block);
+    if (src_dir_block == dest_dir_block &&
+        name_hash(src_name) % chain.size() == name_hash(dest_name) % chain.size()) {
+        dir_entry* entry = get_entry(src_dir_block, src_idx, src_ref, true);
+        if (entry == nullptr) {
+            return -1;
+        }
+        std::strcpy(entry->file_name, dest_name.c_str());
+        dir_entry_removed(src_dir_block, src_name, src_idx);
+        dir_entry_added(dest_dir_block, dest_name, src_idx);
+        rename_handles(src_dir_block, src_name, dest_dir_block, dest_name);
         return 0;
     }
     
-    // Moving to different directory
+    // Moving to another directory block
     // Find free entry in destination
-    int dest_idx = find_free_dir_entry(dest_dir_block);
+    int dest_idx = find_free_dir_entry(dest_dir_block, dest_name);
     if (dest_idx == -1) {
-        delete[] src_entries;
         return -1;
     }
     
     // Copy entry to destination
-    dir_entry* dest_entries = read_dir_entries(dest_dir_block);
-    dest_entries[dest_idx] = src_entries[src_idx];
-    std::strcpy(dest_entries[dest_idx].file_name, dest_name.c_str());
-    write_dir_entries(dest_dir_block, dest_entries);
-    delete[] dest_entries;
-    
-    // Remove entry from source
-    std::memset(&src_entries[src_idx], 0, sizeof(dir_entry));
-    write_dir_entries(src_dir_block, src_entries);
+    BlockRef dest_ref;
+    dir_entry* dest_entry = get_entry(dest_dir_block, dest_idx, dest_ref, true);
+    if (dest_entry == nullptr) {
+        return -1;
+    }
+    *dest_entry = src;
+    std::strcpy(dest_entry->file_name, dest_name.c_str());
+    dest_ref.release();
+    dir_entry_added(dest_dir_block, dest_name, dest_idx);
+    
+    // Remove entry from source, looked up again as the directory may have
+    // grown and been rehashed
+    src_idx = find_entry_in_dir(src_dir_block, src_name);
+    src_entry = get_entry(src_dir_block, src_idx, src_ref, true);
+    if (src_entry == nullptr) {
+        // the file stays where it was, two entries must not share its blocks
+        dest_idx = find_entry_in_dir(dest_dir_block, dest_name);
+        dest_entry = get_entry(dest_dir_block, dest_idx, dest_ref, true);
+        if (dest_entry != nullptr) {
+            std::memset(dest_entry, 0, sizeof(dir_entry));
+            dir_entry_removed(dest_dir_block, dest_name, dest_idx);
+        }
+        return -1;
+    }
+    std::memset(src_entry, 0, sizeof(dir_entry));
+    dir_entry_removed(src_dir_block, src_name, src_idx);
+    rename_handles(src_dir_block, src_name, dest_dir_block, dest_name);
     
-    delete[] src_entries;
     return 0;
 }
 
@@ -667,8 +1914,13 @@ FS::mv(std::string sourcepath, std::string destpath)
 int
 FS::rm(std::string filepath)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Resolve path
-    uint16_t dir_block;
+    uint32_t dir_block;
     std::string filename;
     if (resolve_path(filepath, dir_block, filename) != 0) {
         return -1;
@@ -684,53 +1936,57 @@ FS::rm(std::string filepath)
         return -1;
     }
     
-    // Read directory entries
-    dir_entry* entries = read_dir_entries(dir_block);
+    // Read the directory entry, it is only pinned for writing once it is
+    // sure to be removed
+    BlockRef entry_ref;
+    dir_entry* entry = get_entry(dir_block, file_idx, entry_ref);
+    if (entry == nullptr) {
+        return -1;
+    }
+    dir_entry old_entry = *entry;
+    entry_ref.release();
     
-    // Read FAT
-    read_fat();
+    // An open file can't be removed
+    if (old_entry.type == TYPE_FILE && is_open(dir_block, filename)) {
+        return -1;
+    }
     
     // Handle directory case
-    if (entries[file_idx].type == TYPE_DIR) {
-        // Check if directory is empty (only contains '..')
-        dir_entry* dir_entries = read_dir_entries(entries[file_idx].first_blk);
-        bool is_empty = true;
-        for (int i = 0; i < BLOCK_SIZE / (int)sizeof(dir_entry); i++) {
-            if (dir_entries[i].file_name[0] != '\0' && 
-                std::strcmp(dir_entries[i].file_name, "..") != 0) {
-                is_empty = false;
-                break;
+    if (old_entry.type == TYPE_DIR) {
+        // Check if directory is empty (only contains '..'), in all its blocks
+        std::vector<uint32_t> chain = get_dir_chain(old_entry.first_blk);
+        for (size_t b = 0; b < chain.size(); b++) {
+            BlockRef dir_entries_ref = get_dir_block(chain[b]);
+            if (!dir_entries_ref.valid()) {
+                return -1;
+            }
+            dir_entry* dir_entries = dir_entries_ref.as<dir_entry>();
+            for (int i = 0; i < DIR_ENTRIES; i++) {
+                if (dir_entries[i].file_name[0] != '\0' && 
+                    std::strcmp(dir_entries[i].file_name, "..") != 0) {
+                    return -1; // Directory not empty
+                }
             }
         }
-        delete[] dir_entries;
-        
-        if (!is_empty) {
-            delete[] entries;
-            return -1; // Directory not empty
-        }
-        
-        // Free the directory block
-        fat[entries[file_idx].first_blk] = FAT_FREE;
+    }
+    
+    entry = get_entry(dir_block, file_idx, entry_ref, true);
+    if (entry == nullptr) {
+        return -1;
+    }
+    if (old_entry.type == TYPE_DIR) {
+        // Free the directory blocks, names cached for them are gone too
+        drop_dir(old_entry.first_blk);
+        free_chain(old_entry.first_blk);
     } else {
         // Free all blocks used by the file
-        int16_t current_block = entries[file_idx].first_blk;
-        while (current_block != FAT_EOF && current_block != FAT_FREE) {
-            int16_t next_block = fat[current_block];
-            fat[current_block] = FAT_FREE;
-            current_block = next_block;
-        }
+        free_chain(old_entry.first_blk);
     }
     
-    // Write FAT to disk
-    write_fat();
-    
     // Clear directory entry
-    std::memset(&entries[file_idx], 0, sizeof(dir_entry));
-    
-    // Write directory back to disk
-    write_dir_entries(dir_block, entries);
+    std::memset(entry, 0, sizeof(dir_entry));
+    dir_entry_removed(dir_block, filename, file_idx);
     
-    delete[] entries;
     return 0;
 }
 
@@ -739,8 +1995,13 @@ FS::rm(std::string filepath)
 int
 FS::append(std::string filepath1, std::string filepath2)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Resolve file1 path
-    uint16_t file1_dir_block;
+    uint32_t file1_dir_block;
     std::string file1_name;
     if (resolve_path(filepath1, file1_dir_block, file1_name) != 0 || file1_name.empty()) {
         return -1;
@@ -753,7 +2014,7 @@ FS::append(std::string filepath1, std::string filepath2)
     }
     
     // Resolve file2 path
-    uint16_t file2_dir_block;
+    uint32_t file2_dir_block;
     std::string file2_name;
     if (resolve_path(filepath2, file2_dir_block, file2_name) != 0 || file2_name.empty()) {
         return -1;
@@ -765,111 +2026,99 @@ FS::append(std::string filepath1, std::string filepath2)
         return -1;
     }
     
-    // Read both directories
-    dir_entry* file1_entries = read_dir_entries(file1_dir_block);
-    dir_entry* file2_entries = read_dir_entries(file2_dir_block);
+    // Read both directory entries, file2 is pinned for writing once it is
+    // sure to change
+    BlockRef file1_ref;
+    dir_entry* file1_entry = get_entry(file1_dir_block, file1_idx, file1_ref);
+    BlockRef file2_ref;
+    dir_entry* file2_entry = get_entry(file2_dir_block, file2_idx, file2_ref);
+    if (file1_entry == nullptr || file2_entry == nullptr) {
+        return -1;
+    }
     
     // Check both are files (not directories)
-    if (file1_entries[file1_idx].type != TYPE_FILE || file2_entries[file2_idx].type != TYPE_FILE) {
-        delete[] file1_entries;
-        delete[] file2_entries;
+    if (file1_entry->type != TYPE_FILE || file2_entry->type != TYPE_FILE) {
         return -1;
     }
     
     // Check access rights: need READ on file1, WRITE on file2
-    if (!(file1_entries[file1_idx].access_rights & READ)) {
+    if (!(file1_entry->access_rights & READ)) {
         std::cout << "Error: No read permission on source file\n";
-        delete[] file1_entries;
-        delete[] file2_entries;
         return -1;
     }
-    if (!(file2_entries[file2_idx].access_rights & WRITE)) {
+    if (!(file2_entry->access_rights & WRITE)) {
         std::cout << "Error: No write permission on destination file\n";
-        delete[] file1_entries;
-        delete[] file2_entries;
         return -1;
     }
     
-    // Read FAT
-    read_fat();
-    
     // Read file1 data
     std::string file1_data;
+    read_file_data(file1_entry->first_blk, file1_entry->size, file1_data);
     uint8_t block[BLOCK_SIZE];
-    int16_t current_block = file1_entries[file1_idx].first_blk;
-    uint32_t bytes_remaining = file1_entries[file1_idx].size;
-    
-    while (current_block != FAT_EOF && bytes_remaining > 0) {
-        disk.read(current_block, block);
-        uint32_t bytes_to_read = std::min((uint32_t)BLOCK_SIZE, bytes_remaining);
-        file1_data.append((char*)block, bytes_to_read);
-        bytes_remaining -= bytes_to_read;
-        current_block = fat[current_block];
-    }
     
-    delete[] file1_entries;
     
     if (file1_data.empty()) {
-        delete[] file2_entries;
         return 0; // Nothing to append
     }
+    file1_ref.release();
+    file2_entry = get_entry(file2_dir_block, file2_idx, file2_ref, true);
+    if (file2_entry == nullptr) {
+        return -1;
+    }
     
-    // Find the last block of file2
-    int16_t last_block = file2_entries[file2_idx].first_blk;
-    while (fat[last_block] != FAT_EOF) {
-        last_block = fat[last_block];
+    // file2 gets its own copy of blocks it shares with other files
+    if (unshare_file(file2_dir_block, file2_name, file2_entry) != 0) {
+        return -1;
     }
     
+    // Find the last block of file2
+    int32_t last_block = get_tail(file2_entry->first_blk);
+    
     // Calculate how many bytes are used in the last block
-    uint32_t file2_size = file2_entries[file2_idx].size;
+    uint32_t file2_size = file2_entry->size;
     uint32_t bytes_in_last_block = file2_size % BLOCK_SIZE;
     if (bytes_in_last_block == 0 && file2_size > 0) {
         bytes_in_last_block = BLOCK_SIZE; // Last block is full
     }
     
-    // Read the last block of file2
-    disk.read(last_block, block);
-    
-    // Append file1 data
-    uint32_t file1_offset = 0;
     uint32_t file1_size = file1_data.length();
-    
-    while (file1_offset < file1_size) {
-        uint32_t space_in_block = BLOCK_SIZE - bytes_in_last_block;
-        uint32_t bytes_to_write = std::min(space_in_block, file1_size - file1_offset);
-        
-        if (bytes_to_write > 0) {
-            std::memcpy(block + bytes_in_last_block, file1_data.c_str() + file1_offset, bytes_to_write);
-            disk.write(last_block, block);
-            file1_offset += bytes_to_write;
-            bytes_in_last_block += bytes_to_write;
+    uint32_t space_in_block = BLOCK_SIZE - bytes_in_last_block;
+    
+    // Allocate all new blocks in one call, preferably right after the
+    // last block so the file stays contiguous
+    std::vector<uint32_t> new_blocks;
+    if (file1_size > space_in_block) {
+        int blocks_needed = (file1_size - space_in_block + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (alloc.allocate(blocks_needed, new_blocks, last_block + 1) != 0) {
+            return -1;
         }
-        
-        // If we still have data to write and the block is full, allocate a new block
-        if (file1_offset < file1_size && bytes_in_last_block >= BLOCK_SIZE) {
-            int16_t new_block = find_free_block();
-            if (new_block == -1) {
-                delete[] file2_entries;
-                return -1;
-            }
-            fat[last_block] = new_block;
-            fat[new_block] = FAT_EOF;
-            last_block = new_block;
-            bytes_in_last_block = 0;
-            std::memset(block, 0, BLOCK_SIZE);
+        set_fat(last_block, link_chain(new_blocks));
+        tail_blocks[file2_entry->first_blk] = new_blocks.back();
+    }
+    
+    // Fill up the last block of file2 in place in the cache
+    uint32_t file1_offset = std::min(space_in_block, file1_size);
+    if (file1_offset > 0) {
+        BlockRef last_ref = cache.get_block_mut(last_block);
+        if (!last_ref.valid()) {
+            return -1;
         }
+        std::memcpy(last_ref.bytes() + bytes_in_last_block, file1_data.c_str(), file1_offset);
     }
     
-    // Write FAT to disk
-    write_fat();
+    // Write the rest of file1 to the new blocks
+    for (size_t i = 0; i < new_blocks.size(); i++) {
+        std::memset(block, 0, BLOCK_SIZE);
+        uint32_t bytes_to_write = std::min((uint32_t)BLOCK_SIZE, file1_size - file1_offset);
+        std::memcpy(block, file1_data.c_str() + file1_offset, bytes_to_write);
+        cache.write(new_blocks[i], block);
+        file1_offset += bytes_to_write;
+    }
     
     // Update file2 size
-    file2_entries[file2_idx].size += file1_size;
+    file2_entry->size += file1_size;
     
-    // Write directory back to disk
-    write_dir_entries(file2_dir_block, file2_entries);
     
-    delete[] file2_entries;
     return 0;
 }
 
@@ -878,8 +2127,13 @@ FS::append(std::string filepath1, std::string filepath2)
 int
 FS::mkdir(std::string dirpath)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Resolve path
-    uint16_t parent_block;
+    uint32_t parent_block;
     std::string dirname;
     if (resolve_path(dirpath, parent_block, dirname) != 0) {
         return -1;
@@ -896,27 +2150,25 @@ FS::mkdir(std::string dirpath)
     }
     
     // Find free directory entry in parent directory
-    int free_entry_idx = find_free_dir_entry(parent_block);
+    int free_entry_idx = find_free_dir_entry(parent_block, dirname);
     if (free_entry_idx == -1) {
         return -1;
     }
     
-    // Read FAT
-    read_fat();
-    
     // Find a free block for the new directory
-    int16_t new_dir_block = find_free_block();
-    if (new_dir_block == -1) {
+    std::vector<uint32_t> new_blocks;
+    if (alloc.allocate(1, new_blocks) != 0) {
         return -1;
     }
+    int32_t new_dir_block = new_blocks[0];
     
     // Mark the new block as EOF in FAT
-    fat[new_dir_block] = FAT_EOF;
-    write_fat();
+    set_fat(new_dir_block, FAT_EOF);
     
     // Initialize the new directory block (empty except for '..')
-    dir_entry* new_dir_entries = new dir_entry[BLOCK_SIZE / sizeof(dir_entry)];
-    std::memset(new_dir_entries, 0, BLOCK_SIZE);
+    uint8_t new_dir[BLOCK_SIZE];
+    std::memset(new_dir, 0, BLOCK_SIZE);
+    dir_entry* new_dir_entries = (dir_entry*)new_dir;
     
     // Create '..' entry pointing to parent directory
     std::strcpy(new_dir_entries[0].file_name, "..");
@@ -926,21 +2178,26 @@ FS::mkdir(std::string dirpath)
     new_dir_entries[0].access_rights = READ | WRITE | EXECUTE;
     
     // Write new directory to disk
-    write_dir_entries(new_dir_block, new_dir_entries);
-    delete[] new_dir_entries;
+    cache.write(new_dir_block, new_dir);
     
     // Read parent directory and create entry
-    dir_entry* entries = read_dir_entries(parent_block);
-    std::strcpy(entries[free_entry_idx].file_name, dirname.c_str());
-    entries[free_entry_idx].size = 0;
-    entries[free_entry_idx].first_blk = new_dir_block;
-    entries[free_entry_idx].type = TYPE_DIR;
-    entries[free_entry_idx].access_rights = READ | WRITE | EXECUTE;
-    
-    // Write parent directory back to disk
-    write_dir_entries(parent_block, entries);
+    BlockRef entry_ref;
+    dir_entry* entry = get_entry(parent_block, free_entry_idx, entry_ref, true);
+    if (entry == nullptr) {
+        set_fat(new_dir_block, FAT_FREE);
+        return -1;
+    }
+    std::strcpy(entry->file_name, dirname.c_str());
+    entry->size = 0;
+    entry->first_blk = new_dir_block;
+    entry->type = TYPE_DIR;
+    entry->access_rights = READ | WRITE | EXECUTE;
+    dir_entry_added(parent_block, dirname, free_entry_idx);
+    drop_dir(new_dir_block);
+    // the new block is metadata from now on, it is on the disk before the
+    // entry pointing at it
+    get_dir_chain(new_dir_block);
     
-    delete[] entries;
     return 0;
 }
 
@@ -948,6 +2205,9 @@ FS::mkdir(std::string dirpath)
 int
 FS::cd(std::string dirpath)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
     // Handle special case: cd to root
     if (dirpath == "/") {
         current_dir_block = ROOT_BLOCK;
@@ -955,7 +2215,7 @@ FS::cd(std::string dirpath)
     }
     
     // Resolve path
-    uint16_t dir_block;
+    uint32_t dir_block;
     std::string dirname;
     if (resolve_path(dirpath, dir_block, dirname) != 0) {
         return -1;
@@ -969,38 +2229,28 @@ FS::cd(std::string dirpath)
     
     // Handle ".." specially
     if (dirname == "..") {
-        dir_entry* entries = read_dir_entries(dir_block);
-        for (int i = 0; i < BLOCK_SIZE / (int)sizeof(dir_entry); i++) {
-            if (entries[i].file_name[0] != '\0' && 
-                std::strcmp(entries[i].file_name, "..") == 0) {
-                current_dir_block = entries[i].first_blk;
-                delete[] entries;
-                return 0;
-            }
+        dentry d;
+        if (lookup_entry(dir_block, dirname, d) == -1) {
+            return -1;
         }
-        delete[] entries;
-        return -1;
+        current_dir_block = d.first_blk;
+        return 0;
     }
     
     // Find the directory
-    int dir_idx = find_entry_in_dir(dir_block, dirname);
-    if (dir_idx == -1) {
+    dentry d;
+    if (lookup_entry(dir_block, dirname, d) == -1) {
         return -1; // Directory not found
     }
     
-    // Read directory entries
-    dir_entry* entries = read_dir_entries(dir_block);
-    
     // Check if it's a directory
-    if (entries[dir_idx].type != TYPE_DIR) {
-        delete[] entries;
+    if (d.type != TYPE_DIR) {
         return -1; // Not a directory
     }
     
     // Change to the directory
-    current_dir_block = entries[dir_idx].first_blk;
+    current_dir_block = d.first_blk;
     
-    delete[] entries;
     return 0;
 }
 
@@ -1009,6 +2259,9 @@ FS::cd(std::string dirpath)
 int
 FS::pwd()
 {
+    if (!check_formatted()) {
+        return -1;
+    }
     // If we're at root, just print /
     if (current_dir_block == ROOT_BLOCK) {
         std::cout << "/\n";
@@ -1017,35 +2270,35 @@ FS::pwd()
     
     // Build path by traversing from current to root
     std::string path = "";
-    uint16_t block = current_dir_block;
+    uint32_t block = current_dir_block;
     
     while (block != ROOT_BLOCK) {
-        // Read the current directory to find '..' entry
-        dir_entry* entries = read_dir_entries(block);
-        
-        uint16_t parent_block = ROOT_BLOCK;
-        for (int i = 0; i < BLOCK_SIZE / (int)sizeof(dir_entry); i++) {
-            if (entries[i].file_name[0] != '\0' && 
-                std::strcmp(entries[i].file_name, "..") == 0) {
-                parent_block = entries[i].first_blk;
-                break;
-            }
+        // Look up the '..' entry of the current directory
+        uint32_t parent_block = ROOT_BLOCK;
+        dentry d;
+        if (lookup_entry(block, "..", d) != -1) {
+            parent_block = d.first_blk;
         }
-        delete[] entries;
         
-        // Read parent directory to find current directory's name
-        dir_entry* parent_entries = read_dir_entries(parent_block);
+        // Search all parent directory blocks for current directory's name
+        std::vector<uint32_t> chain = get_dir_chain(parent_block);
         std::string dir_name = "";
         
-        for (int i = 0; i < BLOCK_SIZE / (int)sizeof(dir_entry); i++) {
-            if (parent_entries[i].file_name[0] != '\0' && 
-                parent_entries[i].type == TYPE_DIR &&
-                parent_entries[i].first_blk == block) {
-                dir_name = parent_entries[i].file_name;
-                break;
+        for (size_t b = 0; b < chain.size() && dir_name.empty(); b++) {
+            BlockRef parent_entries_ref = get_dir_block(chain[b]);
+            if (!parent_entries_ref.valid()) {
+                return -1;
+            }
+            dir_entry* parent_entries = parent_entries_ref.as<dir_entry>();
+            for (int i = 0; i < DIR_ENTRIES; i++) {
+                if (parent_entries[i].file_name[0] != '\0' && 
+                    parent_entries[i].type == TYPE_DIR &&
+                    parent_entries[i].first_blk == block) {
+                    dir_name = parent_entries[i].file_name;
+                    break;
+                }
             }
         }
-        delete[] parent_entries;
         
         // Prepend to path
         path = "/" + dir_name + path;
@@ -1063,6 +2316,11 @@ FS::pwd()
 int
 FS::chmod(std::string accessrights, std::string filepath)
 {
+    if (!check_formatted()) {
+        return -1;
+    }
+    command_scope scope(*this);
+    
     // Parse access rights (it's a number like "6" for rw-)
     int rights = std::stoi(accessrights);
     if (rights < 0 || rights > 7) {
@@ -1070,7 +2328,7 @@ FS::chmod(std::string accessrights, std::string filepath)
     }
     
     // Resolve path
-    uint16_t dir_block;
+    uint32_t dir_block;
     std::string filename;
     if (resolve_path(filepath, dir_block, filename) != 0 || filename.empty()) {
         return -1;
@@ -1082,15 +2340,486 @@ FS::chmod(std::string accessrights, std::string filepath)
         return -1;
     }
     
-    // Read directory entries
-    dir_entry* entries = read_dir_entries(dir_block);
-    
     // Update access rights
-    entries[file_idx].access_rights = (uint8_t)rights;
+    BlockRef entry_ref;
+    dir_entry* entry = get_entry(dir_block, file_idx, entry_ref, true);
+    if (entry == nullptr) {
+        return -1;
+    }
+    entry->access_rights = (uint8_t)rights;
+    
+    return 0;
+}
+
+// sync writes all dirty cached blocks to the disk and waits until they
+// are durable on the host disk
+int
+FS::sync()
+{
+    // a transaction is only written at commit
+    if (in_transaction) {
+        return -1;
+    }
+    int ret = writeback();
+    if (disk.sync())
+        ret = -1;
+    close_journal();
+    return ret;
+}
+
+// begin starts a transaction, the commands up to commit() are written
+// to the disk together
+int
+FS::begin()
+{
+    if (!check_formatted()) {
+        return -1;
+    }
+    if (in_transaction) {
+        return -1;
+    }
+    // earlier commands are not part of the transaction
+    int ret = writeback();
+    in_transaction = true;
+    tx_dir_block = current_dir_block;
+    tx_handles = handles;
+    // like a command_scope spanning the transaction, no writeback until
+    // commit
+    command_depth++;
+    return ret;
+}
+
+// commit writes the changes of the transaction to the disk
+int
+FS::commit()
+{
+    if (!in_transaction) {
+        return -1;
+    }
+    // the transaction is written as one journal record, if it doesn't fit
+    // it stays open and can only be aborted
+    write_fat();
+    if (logged_dirty() > journal_capacity()) {
+        std::cout << "Error: The transaction is too big for the journal\n";
+        return -1;
+    }
+    in_transaction = false;
+    command_depth--;
+    for (size_t i = 0; i < tx_freed.size(); i++) {
+        if (get_fat(tx_freed[i]) == FAT_FREE) {
+            alloc.release(tx_freed[i]);
+        }
+    }
+    tx_freed.clear();
+    tx_handles.clear();
+    for (size_t i = 0; i < handles.size(); i++) {
+        handles[i].in_tx = false;
+    }
+    return writeback();
+}
+
+// abort drops the changes of the transaction, the file system is read
+// again from the disk
+int
+FS::abort()
+{
+    if (!in_transaction) {
+        return -1;
+    }
+    in_transaction = false;
+    command_depth--;
+    tx_freed.clear();
+    // the journal holds the commits before begin(), they are written in
+    // place as the file system is read again
+    cache.discard();
+    mount();
+    current_dir_block = tx_dir_block;
+    // handles opened in the transaction are closed, the others get back
+    // the names they had at begin()
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (!handles[i].in_use) {
+            continue;
+        }
+        if (handles[i].in_tx) {
+            handles[i].in_use = false;
+        } else if (i < tx_handles.size() && tx_handles[i].in_use) {
+            handles[i].dir_block = tx_handles[i].dir_block;
+            handles[i].name = tx_handles[i].name;
+        }
+    }
+    tx_handles.clear();
+    // chains may be different on the disk, every cursor is stale
+    chain_gen++;
+    return 0;
+}
+
+// turns write-behind on the disk on or off, -1 if the disk can't do it
+int
+FS::set_write_behind(bool on)
+{
+    return disk.set_write_behind(on);
+}
+
+// sync automatically after every <n> commands (1 = after every command)
+void
+FS::set_sync_interval(unsigned n)
+{
+    sync_interval = n ? n : 1;
+}
+
+// sets the counters of the file system, the cache and the disk to zero
+void
+FS::reset_stats()
+{
+    std::memset(&stats, 0, sizeof(stats));
+    cache.reset_stats();
+    disk.reset_stats();
+}
+
+// Helper function: Get an open handle, nullptr if fd is not open
+FS::file_handle*
+FS::get_handle(int fd)
+{
+    if (fd < 0 || fd >= (int)handles.size() || !handles[fd].in_use) {
+        return nullptr;
+    }
+    return &handles[fd];
+}
+
+// Helper function: Get the directory entry of an open file, looked up by
+// name in its directory as the entry moves when the directory grows
+dir_entry*
+FS::handle_entry(file_handle& h, BlockRef& ref)
+{
+    dentry d;
+    int idx = lookup_entry(h.dir_block, h.name, d);
+    if (idx == -1) {
+        return nullptr;
+    }
+    return get_entry(h.dir_block, idx, ref);
+}
+
+// Helper function: Get block <index> of a file through the cursor of its
+// handle, sequential access only follows one FAT entry per block. Other
+// seeks go through the skip index of the chain.
+// Returns FAT_EOF if the chain is shorter
+int32_t
+FS::handle_block(file_handle& h, int32_t first_blk, uint32_t index)
+{
+    if (h.first_blk != first_blk || h.chain_gen != chain_gen ||
+        index < h.cur_index || index - h.cur_index >= SKIP_STRIDE) {
+        int32_t block = chain_block(first_blk, index);
+        if (block == FAT_EOF) {
+            return FAT_EOF;
+        }
+        h.first_blk = first_blk;
+        h.cur_index = index;
+        h.cur_block = block;
+        h.chain_gen = chain_gen;
+    }
+    while (h.cur_index < index) {
+        int32_t next_block = get_fat(h.cur_block);
+        if (next_block == FAT_EOF || next_block == FAT_FREE) {
+            return FAT_EOF;
+        }
+        h.cur_block = next_block;
+        h.cur_index++;
+    }
+    return h.cur_block;
+}
+
+// Helper function: Check if a file has an open handle
+bool
+FS::is_open(uint32_t dir_block, const std::string& name)
+{
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (handles[i].in_use && handles[i].dir_block == dir_block && handles[i].name == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function: Let the handles of a moved file follow it
+void
+FS::rename_handles(uint32_t dir_block, const std::string& name,
+                   uint32_t new_dir_block, const std::string& new_name)
+{
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (handles[i].in_use && handles[i].dir_block == dir_block && handles[i].name == name) {
+            handles[i].dir_block = new_dir_block;
+            handles[i].name = new_name;
+        }
+    }
+}
+
+// open <filepath> for READ and/or WRITE, with OPEN_CREATE an empty file
+// is created if it does not exist. Returns a handle or -1
+int
+FS::open(std::string filepath, int mode)
+{
+    if (!check_formatted()) {
+        return -1;
+    }
+    if (!(mode & (READ | WRITE))) {
+        return -1;
+    }
+    
+    // Resolve path
+    uint32_t dir_block;
+    std::string filename;
+    if (resolve_path(filepath, dir_block, filename) != 0 || filename.empty()) {
+        return -1;
+    }
+    
+    dentry d;
+    int file_idx = lookup_entry(dir_block, filename, d);
+    if (file_idx == -1) {
+        if (!(mode & OPEN_CREATE) || filename.length() > 55) {
+            return -1;
+        }
+        command_scope scope(*this);
+        
+        // Create an empty file with one zeroed block
+        file_idx = find_free_dir_entry(dir_block, filename);
+        if (file_idx == -1) {
+            return -1;
+        }
+        std::vector<uint32_t> blocks;
+        if (alloc.allocate(1, blocks) != 0) {
+            return -1;
+        }
+        uint8_t block[BLOCK_SIZE];
+        std::memset(block, 0, BLOCK_SIZE);
+        cache.write(blocks[0], block);
+        link_chain(blocks);
+        
+        BlockRef entry_ref;
+        dir_entry* entry = get_entry(dir_block, file_idx, entry_ref, true);
+        if (entry == nullptr) {
+            set_fat(blocks[0], FAT_FREE);
+            return -1;
+        }
+        std::strcpy(entry->file_name, filename.c_str());
+        entry->size = 0;
+        entry->first_blk = blocks[0];
+        entry->type = TYPE_FILE;
+        entry->access_rights = READ | WRITE;
+        dir_entry_added(dir_block, filename, file_idx);
+    }
+    
+    // Check the type and the access rights
+    BlockRef entry_ref;
+    dir_entry* entry = get_entry(dir_block, file_idx, entry_ref);
+    if (entry == nullptr || entry->type != TYPE_FILE) {
+        return -1;
+    }
+    if ((mode & READ) && !(entry->access_rights & READ)) {
+        std::cout << "Error: No read permission\n";
+        return -1;
+    }
+    if ((mode & WRITE) && !(entry->access_rights & WRITE)) {
+        std::cout << "Error: No write permission\n";
+        return -1;
+    }
+    
+    // Use the lowest free handle
+    int fd = 0;
+    while (fd < (int)handles.size() && handles[fd].in_use) {
+        fd++;
+    }
+    if (fd == (int)handles.size()) {
+        handles.push_back(file_handle());
+    }
+    file_handle& h = handles[fd];
+    h.in_use = true;
+    h.dir_block = dir_block;
+    h.name = filename;
+    h.mode = mode & (READ | WRITE);
+    h.offset = 0;
+    h.first_blk = entry->first_blk;
+    h.cur_index = 0;
+    h.cur_block = entry->first_blk;
+    h.chain_gen = chain_gen;
+    h.in_tx = in_transaction;
+    return fd;
+}
+
+// close releases a handle
+int
+FS::close(int fd)
+{
+    file_handle* h = get_handle(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    h->in_use = false;
+    h->name.clear();
+    return 0;
+}
+
+// pread reads up to <len> bytes at <offset>, returns the number of
+// bytes read (0 at the end of the file) or -1
+int
+FS::pread(int fd, void *buf, uint32_t len, uint32_t offset)
+{
+    file_handle* h = get_handle(fd);
+    if (h == nullptr || !(h->mode & READ)) {
+        return -1;
+    }
+    BlockRef entry_ref;
+    dir_entry* entry = handle_entry(*h, entry_ref);
+    if (entry == nullptr) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return 0;
+    }
+    len = std::min(len, entry->size - offset);
+    len = std::min(len, (uint32_t)INT_MAX);
+    int32_t first_blk = entry->first_blk;
+    entry_ref.release();
+    
+    // Copy the data straight out of the cached blocks
+    uint8_t *dest = (uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t pos = offset + done;
+        int32_t block = handle_block(*h, first_blk, pos / BLOCK_SIZE);
+        if (block == FAT_EOF) {
+            break;
+        }
+        BlockRef ref = cache.get_block(block);
+        if (!ref.valid()) {
+            return -1;
+        }
+        uint32_t n = std::min(len - done, (uint32_t)BLOCK_SIZE - pos % BLOCK_SIZE);
+        std::memcpy(dest + done, ref.bytes() + pos % BLOCK_SIZE, n);
+        done += n;
+    }
+    return done;
+}
+
+// pwrite writes <len> bytes at <offset>, the file grows as needed and a
+// gap before <offset> reads as zeros. Returns <len> or -1
+int
+FS::pwrite(int fd, const void *buf, uint32_t len, uint32_t offset)
+{
+    command_scope scope(*this);
     
-    // Write directory back to disk
-    write_dir_entries(dir_block, entries);
+    file_handle* h = get_handle(fd);
+    if (h == nullptr || !(h->mode & WRITE) || len > INT_MAX ||
+        (uint64_t)offset + len > UINT32_MAX) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    BlockRef entry_ref;
+    dir_entry* entry = handle_entry(*h, entry_ref);
+    if (entry == nullptr) {
+        return -1;
+    }
+    
+    // Shared blocks are copied before they are written, then the file
+    // grows to cover the write. The directory block is only dirtied if
+    // the entry changes.
+    dir_entry old_entry = *entry;
+    int ret = unshare_file(h->dir_block, h->name, entry);
+    if (ret == 0 && offset + len > entry->size) {
+        ret = resize_file(entry, offset + len);
+    }
+    if (std::memcmp(entry, &old_entry, sizeof(dir_entry)) != 0) {
+        entry_ref.set_dirty();
+    }
+    if (ret != 0) {
+        return -1;
+    }
     
-    delete[] entries;
+    // Copy the data into the cached blocks in place
+    const uint8_t *src = (const uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t pos = offset + done;
+        int32_t block = handle_block(*h, entry->first_blk, pos / BLOCK_SIZE);
+        if (block == FAT_EOF) {
+            return -1;
+        }
+        BlockRef ref = cache.get_block_mut(block);
+        if (!ref.valid()) {
+            return -1;
+        }
+        uint32_t n = std::min(len - done, (uint32_t)BLOCK_SIZE - pos % BLOCK_SIZE);
+        std::memcpy(ref.bytes() + pos % BLOCK_SIZE, src + done, n);
+        done += n;
+    }
+    return len;
+}
+
+// read reads up to <len> bytes at the position of the handle and advances it
+int
+FS::read(int fd, void *buf, uint32_t len)
+{
+    file_handle* h = get_handle(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    int n = pread(fd, buf, len, h->offset);
+    if (n > 0) {
+        h->offset += n;
+    }
+    return n;
+}
+
+// write writes <len> bytes at the position of the handle and advances it
+int
+FS::write(int fd, const void *buf, uint32_t len)
+{
+    file_handle* h = get_handle(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    int n = pwrite(fd, buf, len, h->offset);
+    if (n > 0) {
+        h->offset += n;
+    }
+    return n;
+}
+
+// seek sets the position of the handle
+int
+FS::seek(int fd, uint32_t offset)
+{
+    file_handle* h = get_handle(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    h->offset = offset;
     return 0;
 }
+
+// truncate changes the size of the file, added bytes are zeros
+int
+FS::truncate(int fd, uint32_t size)
+{
+    command_scope scope(*this);
+    
+    file_handle* h = get_handle(fd);
+    if (h == nullptr || !(h->mode & WRITE)) {
+        return -1;
+    }
+    BlockRef entry_ref;
+    dir_entry* entry = handle_entry(*h, entry_ref);
+    if (entry == nullptr) {
+        return -1;
+    }
+    if (entry->size == size) {
+        return 0;
+    }
+    int ret = unshare_file(h->dir_block, h->name, entry);
+    if (ret == 0) {
+        ret = resize_file(entry, size);
+    }
+    entry_ref.set_dirty();
+    return ret;
+}
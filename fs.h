@@ -1,68 +1,303 @@
 #include <iostream>
 #include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "disk.h"
+#include "cache.h"
+#include "alloc.h"
+#include "dcache.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
 #define ROOT_BLOCK 0
-#define FAT_BLOCK 1
+#define SUPER_BLOCK 1
+#define FAT_START 2 // first FAT block, the FAT is followed by the data blocks
+#define IO_BATCH 32 // blocks moved per vectored read
+#define READAHEAD_BLOCKS 64 // blocks prefetched ahead of a chain read
+#define SKIP_STRIDE 64 // blocks between the entries of a chain skip index
 #define FAT_FREE 0
 #define FAT_EOF -1
+#define FAT_PAGE_ENTRIES (BLOCK_SIZE / (int)sizeof(int32_t)) // FAT entries per FAT block
+#define FS_MAGIC 0x32544146 // "FAT2"
+#define FS_MAX_BLOCKS (1 << 24) // limited by dir_entry.first_blk
+#define REF_PAGE_ENTRIES BLOCK_SIZE // reference counts per refcount block
+#define REF_MAX 255 // most extra references a block can have
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_MIN_BLOCKS 8 // the journal takes 1/32 of the disk within these
+#define JOURNAL_MAX_BLOCKS 1024
+#define JOURNAL_LIST ((BLOCK_SIZE - 20) / (int)sizeof(uint32_t)) // block numbers in a journal header
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
+#define OPEN_CREATE 0x10 // open() creates the file if it does not exist
+
+// cp modes, cp shares the source blocks (reflink) or copies the data
+#define CP_REFLINK_AUTO 0 // share the blocks if possible, else copy
+#define CP_REFLINK_ALWAYS 1 // share the blocks or fail
+#define CP_REFLINK_NEVER 2 // always copy the data
+
+// Block 1 describes the layout of the file system
+struct superblock {
+    uint32_t magic; // FS_MAGIC
+    uint32_t block_size; // BLOCK_SIZE
+    uint32_t no_blocks; // number of blocks in the file system
+    uint32_t fat_start; // first FAT block
+    uint32_t fat_blocks; // number of FAT blocks
+    uint32_t fat_entry_bits; // width of a FAT entry (32)
+    uint32_t data_start; // first block available for files and directories
+    uint32_t used_blocks; // blocks from here on have never been allocated
+    uint32_t ref_start; // first refcount block, follows the FAT
+    uint32_t ref_blocks; // number of refcount blocks
+    uint32_t journal_start; // first journal block, follows the refcounts
+    uint32_t journal_blocks; // number of journal blocks
+};
+
+// The journal is a sequence of transactions from its first block on, each
+// a header followed by copies of the logged blocks. blocks[] lists where
+// the copies belong, then their checksums, then the blocks the
+// transaction freed: blocks[2 * count] .. blocks[2 * count + revoked - 1]
+// are not redone from earlier transactions. The next transaction starts
+// after the copies and has the next seq. A transaction whose header or
+// copies don't match their checksums was not committed, nor are the ones
+// after it.
+struct journal_header {
+    uint32_t magic; // JOURNAL_MAGIC
+    uint32_t seq; // transaction number
+    uint32_t count; // number of logged blocks
+    uint32_t revoked; // number of freed blocks
+    uint32_t checksum; // FNV-1a over the header fields and blocks[]
+    uint32_t blocks[JOURNAL_LIST]; // block numbers, checksums, freed blocks
+};
 
 struct dir_entry {
     char file_name[56]; // name of the file / sub-directory
     uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
-    uint8_t type; // directory (1) or file (0)
-    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    uint32_t first_blk : 24; // index in the FAT for the first block of the file
+    uint32_t type : 1; // directory (1) or file (0)
+    uint32_t access_rights : 7; // read (0x04), write (0x02), execute (0x01)
+};
+
+// A directory is a chain of blocks, each block is one bucket of a hash
+// table: an entry is stored in block name_hash(name) % (number of blocks).
+// Entry index i of a directory is slot i % DIR_ENTRIES of block i / DIR_ENTRIES.
+#define DIR_ENTRIES (BLOCK_SIZE / (int)sizeof(dir_entry)) // entries per directory block
+
+// file system counters, the cache and the disk count their own I/O
+struct fs_stats {
+    uint64_t fat_loads; // FAT pages read into memory
+    uint64_t ref_loads; // refcount pages read into memory
+    uint64_t dir_block_reads; // directory blocks looked at
+    uint64_t journal_commits; // transactions written to the journal
+    uint64_t journal_blocks; // metadata blocks logged by them
+    uint64_t checkpoints; // times the journal was written in place and emptied
 };
 
 class FS {
 private:
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
+    // all block I/O goes through the write-back cache
+    BlockCache cache;
+    // layout of the mounted file system, written back when changed
+    superblock sb;
+    bool sb_dirty;
+    // false for an image of another layout, only format may touch it
+    bool formatted;
+    // size of a FAT entry is 4 bytes
+    // the FAT is paged in one FAT block at a time as it is used, loaded
+    // pages stay authoritative in memory and changed pages are written
+    // back at sync. Entries at or above sb.used_blocks are always free,
+    // so pages past that point are never read.
+    std::vector<std::vector<int32_t> > fat_pages;
+    std::vector<bool> fat_page_dirty;
+    // one byte per block counting the extra files sharing it (0 = one
+    // owner), paged like the FAT. Shared blocks are copied on write.
+    std::vector<std::vector<uint8_t> > ref_pages;
+    std::vector<bool> ref_page_dirty;
+    // free-block bitmap, rebuilt from the FAT at mount
+    BlockAllocator alloc;
+    // name lookups, dropped by every command that changes a directory
+    DentryCache dcache;
+    // name -> slot index of each directory block used so far
+    std::map<uint32_t, DirIndex> dir_indexes;
+    // blocks (hash buckets) of each directory used so far, by first block
+    std::map<uint32_t, std::vector<uint32_t> > dir_chains;
+    // last block of each file appended to so far, by first block
+    std::unordered_map<uint32_t, uint32_t> tail_blocks;
+    // skip index of each file seeked in so far, by first block: entry i
+    // is block i * SKIP_STRIDE of the chain. Built as the chain is walked
+    // and dropped when blocks leave the chain.
+    std::unordered_map<uint32_t, std::vector<uint32_t> > skip_indexes;
+    // every block of the chains in dir_chains
+    std::unordered_set<uint32_t> dir_blocks;
+    // data blocks allocated since the last writeback that were free on the
+    // disk. Nothing on the disk points at them yet, so new directory blocks
+    // among them are written with the file data instead of being logged.
+    // Blocks freed since the last writeback are not fresh when reused, and
+    // no block is fresh after a format until it is written back.
+    std::unordered_set<uint32_t> fresh_blocks;
+    std::unordered_set<uint32_t> freed_blocks;
+    bool track_fresh;
+    // number of the last transaction written to the journal
+    uint32_t journal_seq;
+    // where the next transaction goes, relative to sb.journal_start. The
+    // transactions before it are only written in place at a checkpoint.
+    uint32_t journal_pos;
+    // blocks logged by those transactions and where their newest copy
+    // is, a freed one is revoked
+    std::map<uint32_t, uint32_t> chain_blocks;
+    // the last transaction stays open until a barrier: the commits until
+    // then are added to it instead of starting new ones
+    bool journal_open;
+    struct open_transaction {
+        uint32_t pos; // where its header is
+        uint32_t seq;
+        std::vector<uint32_t> blocks; // the logged blocks, in journal order
+        std::vector<uint32_t> sums; // and their checksums
+        std::vector<uint32_t> revoked;
+    } open_tx;
+    // blocks freed by transactions that may not be on the disk yet, they
+    // aren't fresh until the next barrier
+    std::unordered_set<uint32_t> unsynced_frees;
+    fs_stats stats;
+    // an open file: where its entry is and a cursor into its chain
+    struct file_handle {
+        bool in_use;
+        uint32_t dir_block; // directory holding the entry
+        std::string name;
+        int mode; // READ and/or WRITE
+        uint32_t offset; // position for read() and write()
+        // cur_block is block cur_index of the chain starting at first_blk,
+        // valid while no blocks have left a chain (chain_gen unchanged)
+        int32_t first_blk;
+        uint32_t cur_index;
+        int32_t cur_block;
+        unsigned chain_gen;
+        bool in_tx; // opened inside the current transaction
+    };
+    std::vector<file_handle> handles;
+    // set between begin() and commit() or abort(). Blocks freed inside a
+    // transaction are only reused after it commits, abort() must find
+    // them unchanged.
+    bool in_transaction;
+    std::vector<uint32_t> tx_freed;
+    uint32_t tx_dir_block;
+    std::vector<file_handle> tx_handles;
+    // bumped whenever blocks leave a chain
+    unsigned chain_gen;
     // current directory block
-    uint16_t current_dir_block;
+    uint32_t current_dir_block;
+    // dirty blocks are written back every sync_interval commands
+    unsigned sync_interval;
+    unsigned commands_since_sync;
+    unsigned command_depth;
+
+    // Marks the extent of one mutating command, the cache is synced
+    // when the outermost scope ends and the sync interval has passed
+    struct command_scope {
+        FS &fs;
+        command_scope(FS &fs) : fs(fs) { fs.command_depth++; }
+        ~command_scope() { fs.end_command(); }
+    };
+    void end_command();
+    int writeback();
+    int write_allocations();
+    bool is_meta_block(unsigned block_no);
+    bool is_logged_block(unsigned block_no);
+    unsigned journal_capacity();
+    unsigned logged_dirty();
+    int clear_journal();
+    void close_journal();
+    bool journal_fits(const std::vector<unsigned>& block_nos, const std::vector<unsigned>& revoked);
+    int log_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& bufs,
+                   const std::vector<unsigned>& revoked);
+    int checkpoint();
+    int read_journal(std::vector<uint8_t>& journal, std::vector<unsigned>& block_nos,
+                     std::vector<uint8_t*>& bufs);
     
     // Helper functions
-    void read_fat();
+    void mount();
+    void init_layout(unsigned no_blocks);
+    bool check_formatted();
+    int32_t* fat_page(unsigned page);
     void write_fat();
-    int16_t find_free_block();
-    int find_free_dir_entry(uint16_t dir_block);
-    dir_entry* read_dir_entries(uint16_t dir_block);
-    void write_dir_entries(uint16_t dir_block, dir_entry* entries);
+    int32_t get_fat(uint32_t idx);
+    void set_fat(uint32_t idx, int32_t value);
+    uint8_t* ref_page(unsigned page);
+    unsigned get_ref(uint32_t idx);
+    void set_ref(uint32_t idx, unsigned value);
+    int share_chain(int32_t first_block);
+    int unshare_chain(int32_t& first_block);
+    int32_t get_tail(int32_t first_block);
+    int32_t chain_block(int32_t first_block, uint32_t index);
+    int unshare_file(uint32_t dir_block, const std::string& name, dir_entry* entry);
+    int resize_file(dir_entry* entry, uint32_t new_size);
+    void free_chain(int32_t first_block);
+    int32_t link_chain(const std::vector<uint32_t>& blocks);
+    int append_block(int32_t& first_block, int32_t& last_block, uint8_t *data);
+    int32_t read_chain(int32_t block, unsigned max_blocks, uint8_t *buf, unsigned& count);
+    void read_file_data(int32_t first_blk, uint32_t size, std::string& data);
+    int find_free_dir_entry(uint32_t dir_block, const std::string& name);
     
     // Path resolution helpers
     // Resolves a path and returns the directory block containing the target and the target name
     // Returns -1 on error, 0 on success
-    int resolve_path(const std::string& path, uint16_t& dir_block, std::string& name);
+    int resolve_path(const std::string& path, uint32_t& dir_block, std::string& name);
     // Find entry in a directory, returns entry index or -1 if not found
-    int find_entry_in_dir(uint16_t dir_block, const std::string& name);
+    int find_entry_in_dir(uint32_t dir_block, const std::string& name);
+    // Looks a name up through the dentry cache, returns entry index or -1
+    int lookup_entry(uint32_t dir_block, const std::string& name, dentry& d);
+    // Directory helpers, every change to a directory entry must be
+    // reported so the name caches stay coherent
+    const std::vector<uint32_t>& get_dir_chain(uint32_t dir_block);
+    BlockRef get_dir_block(uint32_t block, bool mut = false);
+    DirIndex* get_dir_index(uint32_t block);
+    dir_entry* get_entry(uint32_t dir_block, int idx, BlockRef& ref, bool mut = false);
+    void dir_entry_added(uint32_t dir_block, const std::string& name, int idx);
+    void dir_entry_removed(uint32_t dir_block, const std::string& name, int idx);
+    void drop_dir(uint32_t dir_block);
+    int grow_dir(uint32_t dir_block);
+    // File handle helpers
+    file_handle* get_handle(int fd);
+    dir_entry* handle_entry(file_handle& h, BlockRef& ref);
+    int32_t handle_block(file_handle& h, int32_t first_blk, uint32_t index);
+    bool is_open(uint32_t dir_block, const std::string& name);
+    void rename_handles(uint32_t dir_block, const std::string& name,
+                        uint32_t new_dir_block, const std::string& new_name);
+
+    // the benchmark times the private path resolution
+    friend class Bench;
 
 public:
-    FS();
+    // disk_mode selects the disk backend, DISK_MODE_FILE or DISK_MODE_MMAP
+    // disk_name is the disk file, e.g. a scratch image for benchmarks
+    FS(int disk_mode = DISK_MODE_FILE, const std::string& disk_name = DISKNAME);
     ~FS();
-    // formats the disk, i.e., creates an empty file system
-    int format();
+    // formats the disk, i.e., creates an empty file system.
+    // no_blocks changes the size of the disk, 0 keeps the current size
+    int format(unsigned no_blocks = 0);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // create reading the data lines from <in> instead of std::cin
+    int create(std::string filepath, std::istream& in);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
+    // writes the content of a file to <out>, e.g. a std::ofstream to export
+    // the file to the host
+    int cat(std::string filepath, std::ostream& out);
     // ls lists the content in the current directory (files and sub-directories)
     int ls();
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
-    // <sourcepath> to a new file <destpath>
-    int cp(std::string sourcepath, std::string destpath);
+    // <sourcepath> to a new file <destpath>. By default the copy shares
+    // the blocks of the source until one of them is written (reflink).
+    int cp(std::string sourcepath, std::string destpath, int reflink = CP_REFLINK_AUTO);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
     int mv(std::string sourcepath, std::string destpath);
@@ -84,6 +319,57 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // sync writes all dirty cached blocks to the disk and waits until they
+    // are durable on the host disk
+    int sync();
+    // sync automatically after every <n> commands (1 = after every command)
+    void set_sync_interval(unsigned n);
+    // queues disk writes for a background thread instead of waiting for
+    // them, file data, FAT and directories still reach the disk in order
+    int set_write_behind(bool on);
+    // I/O counters of the file system, the block cache and the disk
+    const fs_stats& get_fs_stats() { return stats; }
+    const cache_stats& get_cache_stats() { return cache.get_stats(); }
+    const disk_stats& get_disk_stats() { return disk.get_stats(); }
+    // sets all counters to zero
+    void reset_stats();
+
+    // begin starts a transaction: the commands up to commit() change the
+    // FAT and the directories in memory only and are written together, as
+    // one journal transaction. Returns -1 if a transaction is active
+    int begin();
+    // commit writes the changes of the transaction to the disk as one
+    // journal transaction. New directories are not logged, but each
+    // changed FAT, refcount or existing directory block takes one of the
+    // journal's blocks (63 on the default disk). Returns -1 if they don't
+    // fit, the transaction then stays open and can only be aborted.
+    int commit();
+    // abort drops the changes of the transaction and reloads the file
+    // system from the disk. File data overwritten in place inside the
+    // transaction (append, pwrite) may keep the new contents.
+    int abort();
+
+    // File handles give random access to a file without resolving its
+    // path or walking its chain from the start for every access.
+    // open <filepath> for READ and/or WRITE, with OPEN_CREATE an empty file
+    // is created if it does not exist. Returns a handle or -1
+    int open(std::string filepath, int mode);
+    // close releases a handle
+    int close(int fd);
+    // pread reads up to <len> bytes at <offset>, returns the number of
+    // bytes read (0 at the end of the file) or -1
+    int pread(int fd, void *buf, uint32_t len, uint32_t offset);
+    // pwrite writes <len> bytes at <offset>, the file grows as needed and a
+    // gap before <offset> reads as zeros. Returns <len> or -1
+    int pwrite(int fd, const void *buf, uint32_t len, uint32_t offset);
+    // read and write work at the position of the handle and advance it
+    int read(int fd, void *buf, uint32_t len);
+    int write(int fd, const void *buf, uint32_t len);
+    // seek sets the position of the handle
+    int seek(int fd, uint32_t offset);
+    // truncate changes the size of the file, added bytes are zeros
+    int truncate(int fd, uint32_t size);
 };
 
 #endif // __FS_H__
@@ -1,10 +1,35 @@
+#include <cstring>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
 
+int shell_disk_mode = DISK_MODE_FILE;
+bool shell_write_behind = false;
+bool shell_batch = false;
+const char *shell_script = nullptr;
+
 int
 main(int argc, char **argv)
 {
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--mmap") == 0) {
+            // memory map the disk file instead of using pread/pwrite
+            shell_disk_mode = DISK_MODE_MMAP;
+        } else if (std::strcmp(argv[i], "--write-behind") == 0) {
+            // write blocks to the disk file from a background thread
+            shell_write_behind = true;
+        } else if (std::strcmp(argv[i], "--batch") == 0) {
+            // run the script on stdin without prompts
+            shell_batch = true;
+        } else if (std::strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            // run the script file without prompts
+            shell_batch = true;
+            shell_script = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--mmap] [--write-behind] [--batch | -f script]\n";
+            return 1;
+        }
+    }
     Shell shell;
     shell.run();
     return 0;
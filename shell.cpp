@@ -1,21 +1,43 @@
 #include <iostream>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
 #include "shell.h"
 #include "fs.h"
 
-std::string commands_str[] = {
-    "format", "create", "cat", "ls",
-    "cp", "mv", "rm", "append",
-    "mkdir", "cd", "pwd",
-    "chmod",
-    "help", "quit"
+// dispatch table, the shell looks each command name up once per line
+const Shell::op_entry Shell::ops[] = {
+    { "format", &Shell::do_format },
+    { "create", &Shell::do_create },
+    { "cat", &Shell::do_cat },
+    { "ls", &Shell::do_ls },
+    { "cp", &Shell::do_cp },
+    { "mv", &Shell::do_mv },
+    { "rm", &Shell::do_rm },
+    { "append", &Shell::do_append },
+    { "mkdir", &Shell::do_mkdir },
+    { "cd", &Shell::do_cd },
+    { "pwd", &Shell::do_pwd },
+    { "chmod", &Shell::do_chmod },
+    { "sync", &Shell::do_sync },
+    { "begin", &Shell::do_transaction },
+    { "commit", &Shell::do_transaction },
+    { "abort", &Shell::do_transaction },
+    { "stats", &Shell::do_stats },
+    { "help", &Shell::do_help },
+    { "quit", &Shell::do_quit },
 };
 
-Shell::Shell()
+Shell::Shell() : filesystem(shell_disk_mode), running(true), batch(nullptr), batch_pos(0)
 {
     std::cout << "Starting shell...\n";
+    op_stats.assign(sizeof(ops) / sizeof(ops[0]), command_stats());
+    if (shell_write_behind && filesystem.set_write_behind(true))
+        std::cerr << "WARNING: write-behind needs file I/O, writing directly\n";
 }
 
 Shell::~Shell()
@@ -23,230 +45,512 @@ Shell::~Shell()
     std::cout << "Exiting shell...\n";
 }
 
+// returns the index of a command in the dispatch table, or -1
+int
+Shell::find_op(const std::string& name)
+{
+    for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (name == ops[i].name)
+            return i;
+    }
+    return -1;
+}
+
+// splits a command line at blanks and looks the command up
+void
+Shell::parse_line(const std::string& line, command& c)
+{
+    std::string str;
+    c.args.clear();
+    for (size_t i = 0; i < line.length(); i++) {
+        if (line[i] != ' ') {
+            str += line[i];
+        } else {
+            // strip multiple blanks
+            if (!str.empty()) {
+                c.args.push_back(str);
+                str.clear();
+            }
+        }
+    }
+    if (!str.empty())
+        c.args.push_back(str);
+    c.op = c.args.empty() ? -1 : find_op(c.args[0]);
+}
+
+// runs one parsed command, unknown commands print the help. The time
+// and the disk blocks of each command are added to its stats, stats
+// itself is not counted.
+void
+Shell::dispatch(command& c)
+{
+    if (c.args.empty())
+        return; // do nothing
+    if (c.op == -1) {
+        do_help(c);
+        return;
+    }
+    if (ops[c.op].run == &Shell::do_stats) {
+        do_stats(c);
+        return;
+    }
+    disk_stats io0 = filesystem.get_disk_stats();
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    (this->*ops[c.op].run)(c);
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    const disk_stats& io = filesystem.get_disk_stats();
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+    command_stats& s = op_stats[c.op];
+    s.calls++;
+    s.total_us += us;
+    if (us > s.max_us)
+        s.max_us = us;
+    s.blocks_read += io.blocks_read - io0.blocks_read;
+    s.blocks_written += io.blocks_written - io0.blocks_written;
+    int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+    s.hist[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1]++;
+}
+
 void
 Shell::run()
 {
-    bool running = true;
+    if (shell_batch) {
+        if (shell_script == nullptr) {
+            run_batch(std::cin);
+            return;
+        }
+        std::ifstream script(shell_script);
+        if (!script) {
+            std::cerr << "ERROR: Can't open script: " << shell_script << std::endl;
+            return;
+        }
+        run_batch(script);
+        return;
+    }
     std::string line;
-    std::string str;
-    char c;
-    std::vector<std::string> cmd_line;
-    std::string cmd, arg1, arg2;
-    int ret_val = 0;
+    command c;
+    running = true;
     while (running) {
         std::cout << "filesystem> ";
         std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
-            }
-        }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
-            cmd = "";
-        else
-            cmd = cmd_line[0];
+        parse_line(line, c);
 
         if (DEBUG) {
             std::cout << "Line: " << line << std::endl;
-            std::cout << "cmd: " << cmd << std::endl;
-            for (unsigned i = 0; i < cmd_line.size(); ++i)
-                std::cout << "cmd/arg: " << cmd_line[i] << "\n";
+            for (unsigned i = 0; i < c.args.size(); ++i)
+                std::cout << "cmd/arg: " << c.args[i] << "\n";
         }
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
-            }
-        }
+        dispatch(c);
+    }
+}
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            std::cout << "Enter data. Empty line to end.\n";
-            // check return value so everything is ok
-            ret_val = filesystem.create(arg1);
-            if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+// Runs a whole script without prompts. The script is read and parsed up
+// front, then run from the command array. Syncing is deferred to the end
+// of the script or to explicit sync lines.
+void
+Shell::run_batch(std::istream& in)
+{
+    std::stringstream text;
+    text << in.rdbuf();
+    const std::string& script_text = text.str();
+    std::vector<command> script;
+    command c;
+    size_t start = 0;
+    while (start < script_text.length()) {
+        size_t nl = script_text.find('\n', start);
+        size_t end = nl == std::string::npos ? script_text.length() : nl + 1;
+        parse_line(script_text.substr(start, end - start - (nl == std::string::npos ? 0 : 1)), c);
+        // empty lines do nothing, unless a create reads them
+        if (!c.args.empty()) {
+            c.start = start;
+            c.end = end;
+            script.push_back(c);
         }
+        start = end;
+    }
 
-        else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
-            if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+    batch = &text;
+    batch_pos = 0;
+    running = true;
+    filesystem.set_sync_interval(UINT_MAX);
+    for (size_t i = 0; i < script.size() && running; i++) {
+        if (script[i].start < batch_pos)
+            continue; // data of a create
+        dispatch(script[i]);
+    }
+    batch = nullptr;
+    if (filesystem.sync())
+        std::cout << "Error: sync failed, error code -1" << std::endl;
+}
 
-        else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
+void
+Shell::do_format(command& c)
+{
+    if (c.args.size() > 2) {
+        std::cout << "Usage: format [blocks]\n";
+        return;
+    }
+    unsigned no_blocks = 0;
+    if (c.args.size() == 2) {
+        // resize the disk to <blocks> blocks of BLOCK_SIZE bytes
+        int blocks = std::atoi(c.args[1].c_str());
+        if (blocks <= 0) {
+            std::cout << "Usage: format [blocks]\n";
+            return;
         }
+        no_blocks = blocks;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.format(no_blocks);
+    if (ret_val) {
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_create(command& c)
+{
+    if (c.args.size() != 2) {
+        std::cout << "Usage: create <file>\n";
+        return;
+    }
+    int ret_val;
+    if (batch) {
+        // the data lines follow in the script, like on stdin a create
+        // that fails early reads none of them
+        batch->clear();
+        batch->seekg(c.end);
+        ret_val = filesystem.create(c.args[1], *batch);
+        std::streampos pos = batch->tellg();
+        batch_pos = pos == std::streampos(-1) ? SIZE_MAX : (size_t)pos;
+    } else {
+        std::cout << "Enter data. Empty line to end.\n";
+        ret_val = filesystem.create(c.args[1]);
+    }
+    // check return value so everything is ok
+    if (ret_val) {
+        std::cout << "Error: create " << c.args[1];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_cat(command& c)
+{
+    if (c.args.size() != 2) {
+        std::cout << "Usage: cat <file>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.cat(c.args[1]);
+    if (ret_val) {
+        std::cout << "Error: cat " << c.args[1];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_ls(command& c)
+{
+    if (c.args.size() != 1) {
+        std::cout << "Usage: ls\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.ls();
+    if (ret_val) {
+        std::cout << "Error: ls failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+void
+Shell::do_cp(command& c)
+{
+    // the copy shares the blocks of the source by default,
+    // --reflink=never copies the data
+    int reflink = CP_REFLINK_AUTO;
+    std::vector<std::string> args = c.args;
+    if (args.size() == 4) {
+        if (args[1] == "--reflink" || args[1] == "--reflink=always")
+            reflink = CP_REFLINK_ALWAYS;
+        else if (args[1] == "--reflink=never")
+            reflink = CP_REFLINK_NEVER;
+        else if (args[1] != "--reflink=auto") {
+            std::cout << "Usage: cp [--reflink[=always|auto|never]] <oldfile> <newfile>\n";
+            return;
         }
+        args.erase(args.begin() + 1);
+    }
+    if (args.size() != 3) {
+        std::cout << "Usage: cp [--reflink[=always|auto|never]] <oldfile> <newfile>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.cp(args[1], args[2], reflink);
+    if (ret_val) {
+        std::cout << "Error: cp " << args[1] << " " << args[2];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_mv(command& c)
+{
+    if (c.args.size() != 3) {
+        std::cout << "Usage: mv <sourcepath> <destpath>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.mv(c.args[1], c.args[2]);
+    if (ret_val) {
+        std::cout << "Error: mv " << c.args[1] << " " << c.args[2];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_rm(command& c)
+{
+    if (c.args.size() != 2) {
+        std::cout << "Usage: rm <file>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.rm(c.args[1]);
+    if (ret_val) {
+        std::cout << "Error: rm " << c.args[1];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_append(command& c)
+{
+    if (c.args.size() != 3) {
+        std::cout << "Usage: append <filepath1> <filepath2>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.append(c.args[1], c.args[2]);
+    if (ret_val) {
+        std::cout << "Error: append " << c.args[1] << " " << c.args[2];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+void
+Shell::do_mkdir(command& c)
+{
+    if (c.args.size() != 2) {
+        std::cout << "Usage: mkdir <dirpath>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.mkdir(c.args[1]);
+    if (ret_val) {
+        std::cout << "Error: mkdir " << c.args[1];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
+
+void
+Shell::do_cd(command& c)
+{
+    if (c.args.size() != 2) {
+        std::cout << "Usage: cd <dirpath>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.cd(c.args[1]);
+    if (ret_val) {
+        std::cout << "Error: cd " << c.args[1];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "quit")
-            running = false;
+void
+Shell::do_pwd(command& c)
+{
+    if (c.args.size() != 1) {
+        std::cout << "Usage: pwd\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.pwd();
+    if (ret_val) {
+        std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
+    }
+}
+
+void
+Shell::do_chmod(command& c)
+{
+    if (c.args.size() != 3) {
+        std::cout << "Usage: chmod <accessrights> <filepath>\n";
+        return;
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.chmod(c.args[1], c.args[2]);
+    if (ret_val) {
+        std::cout << "Error: chmod " << c.args[1] << " " << c.args[2];
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+void
+Shell::do_sync(command& c)
+{
+    if (c.args.size() > 2) {
+        std::cout << "Usage: sync [interval]\n";
+        return;
+    }
+    if (c.args.size() == 2) {
+        // sync automatically every <interval> commands from now on
+        int interval = std::atoi(c.args[1].c_str());
+        if (interval <= 0) {
+            std::cout << "Usage: sync [interval]\n";
+            return;
         }
+        filesystem.set_sync_interval(interval);
+    }
+    // check return value so everything is ok
+    int ret_val = filesystem.sync();
+    if (ret_val) {
+        std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+    }
+}
 
-        else if (cmd == "") {
-            ; // do nothing
+// begin ... commit runs the commands in between as one transaction,
+// abort drops its changes
+void
+Shell::do_transaction(command& c)
+{
+    const std::string& cmd = c.args[0];
+    if (c.args.size() != 1) {
+        std::cout << "Usage: " << cmd << "\n";
+        return;
+    }
+    int ret_val;
+    if (cmd == "begin")
+        ret_val = filesystem.begin();
+    else if (cmd == "commit")
+        ret_val = filesystem.commit();
+    else
+        ret_val = filesystem.abort();
+    if (ret_val) {
+        std::cout << "Error: " << cmd << " failed, error code " << ret_val << std::endl;
+    }
+}
+
+// stats prints the I/O counters and the time of each command so far,
+// "stats json" prints them as one JSON object and "stats reset" zeroes them
+void
+Shell::do_stats(command& c)
+{
+    if (c.args.size() == 1) {
+        print_stats(false);
+    } else if (c.args.size() == 2 && c.args[1] == "json") {
+        print_stats(true);
+    } else if (c.args.size() == 2 && c.args[1] == "reset") {
+        filesystem.reset_stats();
+        op_stats.assign(op_stats.size(), command_stats());
+    } else {
+        std::cout << "Usage: stats [json|reset]\n";
+    }
+}
+
+// returns the latency in microseconds below which p of the calls fall,
+// as the upper bound of its histogram bucket (at most the slowest call)
+uint64_t
+Shell::percentile(const command_stats& s, double p)
+{
+    uint64_t rank = (uint64_t)(p * s.calls);
+    if (rank >= s.calls)
+        rank = s.calls - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += s.hist[i];
+        if (seen > rank) {
+            uint64_t bound = (uint64_t)2 << i;
+            return bound < s.max_us ? bound : s.max_us;
         }
+    }
+    return s.max_us;
+}
 
-        else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+void
+Shell::print_stats(bool json)
+{
+    const disk_stats& d = filesystem.get_disk_stats();
+    const cache_stats& cs = filesystem.get_cache_stats();
+    const fs_stats& f = filesystem.get_fs_stats();
+    if (json) {
+        std::cout << "{\"commands\": {";
+        const char *sep = "";
+        for (size_t i = 0; i < op_stats.size(); i++) {
+            const command_stats& s = op_stats[i];
+            if (s.calls == 0)
+                continue;
+            std::cout << sep << "\"" << ops[i].name << "\": {\"calls\": " << s.calls
+                      << ", \"total_us\": " << s.total_us << ", \"max_us\": " << s.max_us
+                      << ", \"p50_us\": " << percentile(s, 0.5)
+                      << ", \"p99_us\": " << percentile(s, 0.99)
+                      << ", \"blocks_read\": " << s.blocks_read
+                      << ", \"blocks_written\": " << s.blocks_written << ", \"hist\": [";
+            for (int b = 0; b < LAT_BUCKETS; b++)
+                std::cout << (b ? ", " : "") << s.hist[b];
+            std::cout << "]}";
+            sep = ", ";
         }
+        std::cout << "}, \"disk\": {\"blocks_read\": " << d.blocks_read
+                  << ", \"blocks_written\": " << d.blocks_written
+                  << ", \"bytes_read\": " << d.bytes_read
+                  << ", \"bytes_written\": " << d.bytes_written
+                  << ", \"flushes\": " << d.flushes << ", \"syncs\": " << d.syncs
+                  << ", \"barriers\": " << d.barriers << "}"
+                  << ", \"cache\": {\"hits\": " << cs.hits << ", \"misses\": " << cs.misses
+                  << ", \"evictions\": " << cs.evictions
+                  << ", \"writebacks\": " << cs.writebacks << "}"
+                  << ", \"fs\": {\"fat_loads\": " << f.fat_loads
+                  << ", \"ref_loads\": " << f.ref_loads
+                  << ", \"dir_block_reads\": " << f.dir_block_reads
+                  << ", \"journal_commits\": " << f.journal_commits
+                  << ", \"journal_blocks\": " << f.journal_blocks
+                  << ", \"checkpoints\": " << f.checkpoints << "}}\n";
+        return;
+    }
+    std::cout << "command\t calls\t avg_us\t p50_us\t p99_us\t max_us\t blocks_read\t blocks_written\n";
+    for (size_t i = 0; i < op_stats.size(); i++) {
+        const command_stats& s = op_stats[i];
+        if (s.calls == 0)
+            continue;
+        std::cout << ops[i].name << "\t " << s.calls << "\t " << s.total_us / s.calls
+                  << "\t " << percentile(s, 0.5) << "\t " << percentile(s, 0.99)
+                  << "\t " << s.max_us << "\t " << s.blocks_read
+                  << "\t " << s.blocks_written << "\n";
     }
+    std::cout << "disk: " << d.blocks_read << " blocks read (" << d.bytes_read << " bytes), "
+              << d.blocks_written << " blocks written (" << d.bytes_written << " bytes), "
+              << d.flushes << " flushes, " << d.syncs << " syncs, "
+              << d.barriers << " barriers\n";
+    std::cout << "cache: " << cs.hits << " hits, " << cs.misses << " misses, "
+              << cs.evictions << " evictions, " << cs.writebacks << " writebacks\n";
+    std::cout << "fs: " << f.fat_loads << " FAT loads, " << f.ref_loads << " refcount loads, "
+              << f.dir_block_reads << " directory block reads, "
+              << f.journal_commits << " journal commits (" << f.journal_blocks << " blocks), "
+              << f.checkpoints << " checkpoints\n";
+}
+
+void
+Shell::do_help(command&)
+{
+    std::cout << "Available commands:\n";
+    std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, begin, commit, abort, stats, help, quit\n";
+}
+
+void
+Shell::do_quit(command&)
+{
+    running = false;
 }
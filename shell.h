@@ -1,12 +1,80 @@
 #include <iostream>
+#include <cstdint>
+#include <string>
+#include <vector>
 #include "fs.h"
 
 #ifndef __SHELL_H__
 #define __SHELL_H__
 
+// disk backend for the shell's file system, set by main() from the
+// command line before the shell is created
+extern int shell_disk_mode;
+// set by main() to write blocks from a background thread
+extern bool shell_write_behind;
+// set by main() to run a script without prompts: from the file
+// shell_script, or from stdin if it is nullptr
+extern bool shell_batch;
+extern const char *shell_script;
+
+// latency histogram buckets of a command, bucket i counts the calls that
+// took 2^i to 2^(i+1) microseconds (bucket 0 also the faster ones)
+#define LAT_BUCKETS 32
+
 class Shell {
 private:
     FS filesystem;
+    bool running;
+    // the script in batch mode, create reads its data from here. Lines
+    // before batch_pos were consumed as data and are not run.
+    std::istream *batch;
+    size_t batch_pos;
+    // one parsed command line
+    struct command {
+        int op; // index in the dispatch table, -1 if unknown
+        std::vector<std::string> args; // args[0] is the command name
+        size_t start, end; // offsets of the line in a script
+    };
+    typedef void (Shell::*handler)(command& c);
+    struct op_entry {
+        const char *name;
+        handler run;
+    };
+    static const op_entry ops[];
+    // time and disk I/O of the commands run so far, one per table entry
+    struct command_stats {
+        uint64_t calls;
+        uint64_t total_us;
+        uint64_t max_us;
+        uint64_t blocks_read;
+        uint64_t blocks_written;
+        uint64_t hist[LAT_BUCKETS];
+    };
+    std::vector<command_stats> op_stats;
+    uint64_t percentile(const command_stats& s, double p);
+    void print_stats(bool json);
+    static int find_op(const std::string& name);
+    static void parse_line(const std::string& line, command& c);
+    void dispatch(command& c);
+    void run_batch(std::istream& in);
+    // command handlers
+    void do_format(command& c);
+    void do_create(command& c);
+    void do_cat(command& c);
+    void do_ls(command& c);
+    void do_cp(command& c);
+    void do_mv(command& c);
+    void do_rm(command& c);
+    void do_append(command& c);
+    void do_mkdir(command& c);
+    void do_cd(command& c);
+    void do_pwd(command& c);
+    void do_chmod(command& c);
+    void do_sync(command& c);
+    void do_transaction(command& c);
+    void do_stats(command& c);
+    void do_help(command& c);
+    void do_quit(command& c);
 public:
     Shell();
     ~Shell();
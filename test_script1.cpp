@@ -226,9 +226,9 @@ Shell::run()
     std::cout << "Actual output:" << std::endl;
     ret_val = filesystem.ls();
 
-    std::cout << "--------\nAdding one more file should give an error..." << std::endl;
+    std::cout << "--------\nAdding one more file should work, the directory grows to more blocks..." << std::endl;
     std::cout << "Expected output:" << std::endl;
-    std::cout << "... some kind of error message" << std::endl;
+    std::cout << "hej heja hejare" << std::endl;
     std::cout << "Actual output:" << std::endl;
     arg1 = "fx";
     fw = open("input1.txt", O_RDONLY);
@@ -240,6 +240,12 @@ Shell::run()
         std::cout << " failed, error code " << ret_val << std::endl;
     }
     close(fw);
+    ret_val = filesystem.cat(arg1);
+    if (ret_val)
+    {
+        std::cout << "Error: cat " << arg1;
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
 
     PRINTDIV2;
 
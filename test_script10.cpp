@@ -0,0 +1,198 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <csignal>
+#include <sys/resource.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disk, the tests unmount and mount it again
+#define TEST_DISK "test10.bin"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// <lines> lines of 63 characters, 64 lines fill a block
+static std::string
+file_data(char c, int lines)
+{
+    std::string data;
+    for (int i = 0; i < lines; i++) {
+        data += std::string(63, c + i % 10) + "\n";
+    }
+    return data;
+}
+
+// creates <path> holding <data>, which ends with a newline
+static int
+create_file(FS* fs, const std::string& path, const std::string& data)
+{
+    std::istringstream in(data + "\n");
+    return fs->create(path, in);
+}
+
+// tells if the file <path> holds <data>
+static bool
+file_is(FS* fs, const std::string& path, const std::string& data)
+{
+    std::ostringstream out;
+    return fs->cat(path, out) == 0 && out.str() == data;
+}
+
+// fills <blk> with a pattern of <block_no> and <round>
+static void
+fill_block(uint8_t* blk, unsigned block_no, unsigned round)
+{
+    for (unsigned i = 0; i < BLOCK_SIZE; i++) {
+        blk[i] = (uint8_t)(block_no * 7 + round + i);
+    }
+}
+
+// counts the blocks <first> .. <last>-1 of <disk> that hold their pattern
+static unsigned
+count_blocks(Disk& disk, unsigned first, unsigned last, unsigned round)
+{
+    std::vector<uint8_t> blk(BLOCK_SIZE), want(BLOCK_SIZE);
+    unsigned ok = 0;
+    for (unsigned i = first; i < last; i++) {
+        fill_block(&want[0], i, round);
+        if (disk.read(i, &blk[0]) == 0 && blk == want) {
+            ok++;
+        }
+    }
+    return ok;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    FS* fs;
+    Disk* disk;
+    std::string a = file_data('a', 200); // 4 blocks
+    std::string b = file_data('b', 30);
+    std::string big = file_data('g', 64 * 1200);
+    std::vector<uint8_t> blk(BLOCK_SIZE);
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 10 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing write-behind..." << std::endl;
+    std::cout << "Use " << TEST_DISK << " as test disk..." << std::endl;
+    std::remove(TEST_DISK);
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    ret_val = fs->set_write_behind(true);
+    if (ret_val)
+        std::cout << "Error: set_write_behind failed, error code " << ret_val << std::endl;
+    fs->format();
+    fs->mkdir("d");
+    for (int i = 0; i < 20; i++) {
+        create_file(fs, "d/f" + std::to_string(i), b);
+    }
+    create_file(fs, "a", a);
+    fs->cp("a", "d/a");
+    fs->append("a", "d/f0");
+    fs->mv("d/f1", "f1");
+    fs->rm("d/f2");
+    // many commands between the syncs, more blocks than the queue holds
+    fs->set_sync_interval(1000);
+    create_file(fs, "big", big);
+    fs->rm("d/f3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "sync 0" << std::endl;
+    std::cout << "a 1, d/a 1, d/f0 1, f1 1, d/f2 0, d/f3 0, big 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "sync " << fs->sync() << std::endl;
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "a " << file_is(fs, "a", a) << ", d/a " << file_is(fs, "d/a", a)
+              << ", d/f0 " << file_is(fs, "d/f0", b + a) << ", f1 " << file_is(fs, "f1", b)
+              << ", d/f2 " << file_is(fs, "d/f2", b) << ", d/f3 " << file_is(fs, "d/f3", b)
+              << ", big " << file_is(fs, "big", big) << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::cout << "Testing a full write-behind queue..." << std::endl;
+    // twice as many blocks as the queue holds, writers wait for room
+    // instead of dropping blocks
+    disk = new Disk(DISK_MODE_FILE, TEST_DISK);
+    disk->set_write_behind(true);
+    std::vector<std::vector<uint8_t> > data(WB_QUEUE_BLOCKS, std::vector<uint8_t>(BLOCK_SIZE));
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> bufs;
+    for (unsigned i = 0; i < WB_QUEUE_BLOCKS; i++) {
+        fill_block(&data[i][0], i, 1);
+        block_nos.push_back(i);
+        bufs.push_back(&data[i][0]);
+    }
+    disk->write_blocks(block_nos, bufs);
+    disk->barrier();
+    for (unsigned i = WB_QUEUE_BLOCKS; i < 2 * WB_QUEUE_BLOCKS; i++) {
+        fill_block(&blk[0], i, 1);
+        disk->write(i, &blk[0]);
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "2048 blocks before the sync, sync 0" << std::endl;
+    std::cout << "2048 blocks after remount" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << count_blocks(*disk, 0, 2 * WB_QUEUE_BLOCKS, 1) << " blocks before the sync, ";
+    std::cout << "sync " << disk->sync() << std::endl;
+    delete disk;
+    disk = new Disk(DISK_MODE_FILE, TEST_DISK);
+    std::cout << count_blocks(*disk, 0, 2 * WB_QUEUE_BLOCKS, 1) << " blocks after remount" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing a failed write-behind write..." << std::endl;
+    // writes past the file size limit fail with EFBIG instead of a signal
+    disk->set_write_behind(true);
+    struct rlimit old_limit, limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = 1000 * BLOCK_SIZE;
+    // nothing is printed while the limit holds, stdout may be a file
+    std::cout.flush();
+    std::signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    fill_block(&blk[0], 10, 2);
+    int write_ret = disk->write(10, &blk[0]);
+    fill_block(&blk[0], 1500, 2);
+    int failed_ret = disk->write(1500, &blk[0]);
+    int sync_ret = disk->sync();
+    int next_ret = disk->sync();
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    std::signal(SIGXFSZ, SIG_DFL);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "write 0, write 0, sync -1, sync 0" << std::endl;
+    std::cout << "block 10 1, block 1500 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "write " << write_ret << ", write " << failed_ret
+              << ", sync " << sync_ret << ", sync " << next_ret << std::endl;
+    delete disk;
+    disk = new Disk(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "block 10 " << count_blocks(*disk, 10, 11, 2)
+              << ", block 1500 " << count_blocks(*disk, 1500, 1501, 2) << std::endl;
+    delete disk;
+    PRINTDIV2;
+
+    std::remove(TEST_DISK);
+    std::cout << "... Task 10 done" << std::endl;
+    PRINTDIV;
+}
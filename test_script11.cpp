@@ -0,0 +1,155 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disk, the tests unmount and mount it again
+#define TEST_DISK "test11.bin"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// creates <path> holding <data>
+static int
+create_file(FS* fs, const std::string& path, const std::string& data)
+{
+    std::istringstream in(data + "\n\n");
+    return fs->create(path, in);
+}
+
+// the counters of the cache and the file system since the last reset
+static void
+print_reads(FS* fs)
+{
+    const cache_stats& cs = fs->get_cache_stats();
+    const fs_stats& f = fs->get_fs_stats();
+    std::cout << cs.hits << " hits, " << cs.misses << " misses, "
+              << f.fat_loads << " FAT loads, " << f.dir_block_reads << " directory block reads"
+              << std::endl;
+}
+
+// the write counters since the last reset
+static void
+print_writes(FS* fs)
+{
+    const disk_stats& d = fs->get_disk_stats();
+    const fs_stats& f = fs->get_fs_stats();
+    std::cout << d.barriers << " barriers, " << d.syncs << " syncs, "
+              << f.journal_commits << " journal commits, " << f.checkpoints << " checkpoints"
+              << std::endl;
+}
+
+void
+Shell::run()
+{
+    FS* fs;
+    std::ostringstream out;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 11 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing the read counters..." << std::endl;
+    std::cout << "Use " << TEST_DISK << " as test disk..." << std::endl;
+    std::remove(TEST_DISK);
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    create_file(fs, "a", "hej heja hejare");
+    fs->mkdir("d");
+    create_file(fs, "d/b", "hej");
+    // 1000 blocks, the end of the file is in the second FAT page
+    create_file(fs, "big", std::string(1000 * BLOCK_SIZE - 2, 'x'));
+    delete fs;
+    // the mount loads the FAT pages in use to find the free blocks. Then
+    // the first lookup in a directory block builds its name index, reads
+    // the entry and get_entry() pins it again. Later lookups hit the
+    // dentry cache.
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "mount: 0 hits, 3 misses, 2 FAT loads, 0 directory block reads" << std::endl;
+    std::cout << "cat a: 2 hits, 2 misses, 0 FAT loads, 3 directory block reads" << std::endl;
+    std::cout << "cat a: 2 hits, 0 misses, 0 FAT loads, 1 directory block reads" << std::endl;
+    std::cout << "cat d/b: 3 hits, 2 misses, 0 FAT loads, 4 directory block reads" << std::endl;
+    std::cout << "cat big: 2 hits, 1000 misses, 0 FAT loads, 2 directory block reads" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "mount: ";
+    print_reads(fs);
+    fs->reset_stats();
+    fs->cat("a", out);
+    std::cout << "cat a: ";
+    print_reads(fs);
+    fs->reset_stats();
+    fs->cat("a", out);
+    std::cout << "cat a: ";
+    print_reads(fs);
+    fs->reset_stats();
+    fs->cat("d/b", out);
+    std::cout << "cat d/b: ";
+    print_reads(fs);
+    fs->reset_stats();
+    fs->cat("big", out);
+    std::cout << "cat big: ";
+    print_reads(fs);
+    PRINTDIV2;
+
+    std::cout << "Testing the write counters..." << std::endl;
+    // one sync per command, a create joins the open journal transaction
+    // and a new directory block waits for a barrier
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "create: 0 barriers, 0 syncs, 1 journal commits, 0 checkpoints" << std::endl;
+    std::cout << "3 creates: 0 barriers, 0 syncs, 3 journal commits, 0 checkpoints" << std::endl;
+    std::cout << "mkdir: 1 barriers, 0 syncs, 1 journal commits, 0 checkpoints" << std::endl;
+    std::cout << "sync: 0 barriers, 1 syncs, 0 journal commits, 0 checkpoints" << std::endl;
+    std::cout << "transaction: 1 barriers, 0 syncs, 1 journal commits, 0 checkpoints" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    fs->reset_stats();
+    create_file(fs, "c", "hej");
+    std::cout << "create: ";
+    print_writes(fs);
+    fs->reset_stats();
+    for (int i = 0; i < 3; i++) {
+        create_file(fs, "c" + std::to_string(i), "hej");
+    }
+    std::cout << "3 creates: ";
+    print_writes(fs);
+    fs->reset_stats();
+    fs->mkdir("e");
+    std::cout << "mkdir: ";
+    print_writes(fs);
+    fs->reset_stats();
+    fs->sync();
+    std::cout << "sync: ";
+    print_writes(fs);
+    fs->reset_stats();
+    fs->begin();
+    fs->mkdir("f");
+    create_file(fs, "f/x", "hej");
+    create_file(fs, "y", "hej");
+    fs->commit();
+    std::cout << "transaction: ";
+    print_writes(fs);
+    delete fs;
+    PRINTDIV2;
+
+    std::remove(TEST_DISK);
+    std::cout << "... Task 11 done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,206 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disk, the tests unmount and mount it again
+#define TEST_DISK "test6.bin"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// creates <path> holding <data>
+static int
+create_file(FS* fs, const std::string& path, const std::string& data)
+{
+    std::istringstream in(data + "\n\n");
+    return fs->create(path, in);
+}
+
+// tells if the file <path> holds its own name
+static bool
+file_ok(FS* fs, const std::string& path)
+{
+    std::ostringstream out;
+    return fs->cat(path, out) == 0 && out.str() == path + "\n";
+}
+
+// counts the files <prefix>0 .. <prefix>n-1 (with <suffix>) that hold
+// their own name
+static int
+count_files(FS* fs, const std::string& prefix, const std::string& suffix, int n)
+{
+    int ok = 0;
+    for (int i = 0; i < n; i++) {
+        if (file_ok(fs, prefix + std::to_string(i) + suffix)) {
+            ok++;
+        }
+    }
+    return ok;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    FS* fs;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 6 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing journal replay..." << std::endl;
+    std::cout << "Use " << TEST_DISK << " as test disk..." << std::endl;
+    std::remove(TEST_DISK);
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    ret_val = create_file(fs, "a", "hej heja hejare");
+    if (ret_val)
+        std::cout << "Error: create(a) failed, error code " << ret_val << std::endl;
+    // a crash: the file system is never unmounted. The create is in the
+    // journal, the root directory block on the disk is still empty.
+    std::cout << "Crashing before the journal is written in place..." << std::endl;
+    int fr = open(TEST_DISK, O_RDONLY);
+    std::vector<dir_entry> root(DIR_ENTRIES);
+    if (fr < 0 || pread(fr, &root[0], BLOCK_SIZE, ROOT_BLOCK * BLOCK_SIZE) != BLOCK_SIZE)
+        std::cout << "Error: can't read " << TEST_DISK << std::endl;
+    close(fr);
+    int in_place = 0;
+    for (int i = 0; i < DIR_ENTRIES; i++) {
+        if (root[i].file_name[0] != '\0')
+            in_place++;
+    }
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 entries in place" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "a\t file\t rw-\t 16" << std::endl;
+    std::cout << "hej heja hejare" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << in_place << " entries in place" << std::endl;
+    fs->ls();
+    fs->cat("a");
+    delete fs;
+    PRINTDIV2;
+
+    std::cout << "Testing remount of a large directory..." << std::endl;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    // the last create grows the root from 32 to 64 blocks, the largest
+    // transaction of the test
+    for (int i = 0; i < 1847; i++) {
+        std::string name = "f" + std::to_string(i);
+        ret_val = create_file(fs, name, name);
+        if (ret_val)
+            std::cout << "Error: create(" << name << ") failed, error code " << ret_val << std::endl;
+    }
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "1847 files" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << count_files(fs, "f", "", 1847) << " files" << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::cout << "Testing remount after a large group commit..." << std::endl;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    for (int i = 0; i < 100; i++) {
+        std::string name = "d" + std::to_string(i);
+        fs->mkdir(name);
+        create_file(fs, name + "/x", name + "/x");
+    }
+    fs->sync();
+    // changes 100 existing directories, more than one journal transaction holds
+    fs->set_sync_interval(1000);
+    for (int i = 0; i < 100; i++) {
+        std::string name = "d" + std::to_string(i) + "/y";
+        ret_val = create_file(fs, name, name);
+        if (ret_val)
+            std::cout << "Error: create(" << name << ") failed, error code " << ret_val << std::endl;
+    }
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "100 files x, 100 files y" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << count_files(fs, "d", "/x", 100) << " files x, ";
+    std::cout << count_files(fs, "d", "/y", 100) << " files y" << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::cout << "Testing remount after a transaction..." << std::endl;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    create_file(fs, "keep", "keep");
+    fs->begin();
+    for (int i = 0; i < 70; i++) {
+        std::string name = "d" + std::to_string(i);
+        fs->mkdir(name);
+        create_file(fs, name + "/x", name + "/x");
+    }
+    ret_val = fs->commit();
+    if (ret_val)
+        std::cout << "Error: commit failed, error code " << ret_val << std::endl;
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "keep 1, 70 files x" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "keep " << file_ok(fs, "keep") << ", ";
+    std::cout << count_files(fs, "d", "/x", 70) << " files x" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing a transaction too big for the journal..." << std::endl;
+    // changes 70 existing directories, more than the journal holds
+    fs->begin();
+    fs->rm("keep");
+    for (int i = 0; i < 70; i++) {
+        std::string name = "d" + std::to_string(i) + "/y";
+        create_file(fs, name, name);
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Error: The transaction is too big for the journal" << std::endl;
+    std::cout << "Error: commit failed, error code -1" << std::endl;
+    std::cout << "keep 1, 70 files x, 0 files y" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = fs->commit();
+    if (ret_val)
+        std::cout << "Error: commit failed, error code " << ret_val << std::endl;
+    ret_val = fs->abort();
+    if (ret_val)
+        std::cout << "Error: abort failed, error code " << ret_val << std::endl;
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "keep " << file_ok(fs, "keep") << ", ";
+    std::cout << count_files(fs, "d", "/x", 70) << " files x, ";
+    std::cout << count_files(fs, "d", "/y", 70) << " files y" << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::remove(TEST_DISK);
+    std::cout << "... Task 6 done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disk, the tests unmount and mount it again
+#define TEST_DISK "test7.bin"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// <lines> lines of 63 characters, 64 lines fill a block
+static std::string
+file_data(char c, int lines)
+{
+    std::string data;
+    for (int i = 0; i < lines; i++) {
+        data += std::string(63, c + i % 10) + "\n";
+    }
+    return data;
+}
+
+// creates <path> holding <data>, which ends with a newline
+static int
+create_file(FS* fs, const std::string& path, const std::string& data)
+{
+    std::istringstream in(data + "\n");
+    return fs->create(path, in);
+}
+
+// tells if the file <path> holds <data>
+static bool
+file_is(FS* fs, const std::string& path, const std::string& data)
+{
+    std::ostringstream out;
+    return fs->cat(path, out) == 0 && out.str() == data;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    FS* fs;
+    std::string a = file_data('a', 200); // 4 blocks
+    std::string b = file_data('b', 100);
+    std::string x = file_data('x', 300);
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 7 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing reflink copies..." << std::endl;
+    std::cout << "Use " << TEST_DISK << " as test disk..." << std::endl;
+    std::remove(TEST_DISK);
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    create_file(fs, "a", a);
+    create_file(fs, "b", b);
+    std::cout << "cp(a,s1), cp(a,s2), cp --reflink=never (a,c), append(b,s2)..." << std::endl;
+    ret_val = fs->cp("a", "s1", CP_REFLINK_ALWAYS);
+    if (ret_val)
+        std::cout << "Error: cp(a,s1) failed, error code " << ret_val << std::endl;
+    fs->cp("a", "s2");
+    fs->cp("a", "c", CP_REFLINK_NEVER);
+    // s2 gets its own copy of the shared last block
+    fs->append("b", "s2");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "a 1, s1 1, s2 1, c 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "a " << file_is(fs, "a", a) << ", s1 " << file_is(fs, "s1", a)
+              << ", s2 " << file_is(fs, "s2", a + b) << ", c " << file_is(fs, "c", a) << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing rm of shared files..." << std::endl;
+    // blocks freed too early are reused by x and show up in the copies
+    fs->rm("a");
+    create_file(fs, "x", x);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "s1 1, s2 1, x 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "s1 " << file_is(fs, "s1", a) << ", s2 " << file_is(fs, "s2", a + b)
+              << ", x " << file_is(fs, "x", x) << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing reference counts after remount..." << std::endl;
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->rm("s2");
+    fs->rm("x");
+    create_file(fs, "y", x);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "s1 1, c 1, y 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "s1 " << file_is(fs, "s1", a) << ", c " << file_is(fs, "c", a)
+              << ", y " << file_is(fs, "y", x) << std::endl;
+    // the last owner frees the blocks, no block is leaked if a file as
+    // large as the data area (blocks 69-2047) fits again
+    fs->rm("s1");
+    fs->rm("c");
+    fs->rm("y");
+    fs->rm("b");
+    std::string full = file_data('f', 1979 * 64);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "full 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = create_file(fs, "full", full);
+    if (ret_val)
+        std::cout << "Error: create(full) failed, error code " << ret_val << std::endl;
+    std::cout << "full " << file_is(fs, "full", full) << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::remove(TEST_DISK);
+    std::cout << "... Task 7 done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,154 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disk, the tests unmount and mount it again
+#define TEST_DISK "test8.bin"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// <len> bytes of a pattern starting with <c>
+static std::string
+pattern(char c, uint32_t len)
+{
+    std::string data;
+    for (uint32_t i = 0; i < len; i++) {
+        data += (char)(c + i % 23);
+    }
+    return data;
+}
+
+// writes <data> at <offset> of <file>, the copy of the file contents
+static void
+write_at(std::string& file, const std::string& data, uint32_t offset)
+{
+    if (file.size() < offset + data.size()) {
+        file.resize(offset + data.size(), '\0');
+    }
+    file.replace(offset, data.size(), data);
+}
+
+// tells if the open file <fd> holds <file>, read with pread()
+static bool
+handle_is(FS* fs, int fd, const std::string& file)
+{
+    std::vector<char> buf(file.size() + 100);
+    int n = fs->pread(fd, &buf[0], buf.size(), 0);
+    return n == (int)file.size() && std::string(&buf[0], n) == file;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    FS* fs;
+    int fd;
+    std::string file; // what the file should hold
+    std::string data;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 8 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing pwrite() and pread()..." << std::endl;
+    std::cout << "Use " << TEST_DISK << " as test disk..." << std::endl;
+    std::remove(TEST_DISK);
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fs->format();
+    fd = fs->open("h", READ | WRITE | OPEN_CREATE);
+    if (fd < 0)
+        std::cout << "Error: open(h) failed, error code " << fd << std::endl;
+    data = pattern('a', 10000);
+    fs->pwrite(fd, data.data(), data.size(), 0);
+    write_at(file, data, 0);
+    // overwrite across a block boundary
+    data = pattern('A', 300);
+    fs->pwrite(fd, data.data(), data.size(), 4000);
+    write_at(file, data, 4000);
+    // past the end, the gap reads as zeros
+    data = pattern('0', 5000);
+    fs->pwrite(fd, data.data(), data.size(), 20000);
+    write_at(file, data, 20000);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "h 1, 25000 bytes" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "h " << handle_is(fs, fd, file) << ", " << file.size() << " bytes" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing seek(), read() and write()..." << std::endl;
+    data = pattern('k', 9000);
+    fs->seek(fd, 12000);
+    fs->write(fd, data.data(), 4500);
+    fs->write(fd, data.data() + 4500, 4500);
+    write_at(file, data, 12000);
+    std::vector<char> buf(6000);
+    fs->seek(fd, 11000);
+    int n1 = fs->read(fd, &buf[0], 3000);
+    int n2 = fs->read(fd, &buf[3000], 3000);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "read 3000 + 3000 bytes, 1" << std::endl;
+    std::cout << "h 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "read " << n1 << " + " << n2 << " bytes, "
+              << (std::string(&buf[0], 6000) == file.substr(11000, 6000)) << std::endl;
+    std::cout << "h " << handle_is(fs, fd, file) << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing truncate()..." << std::endl;
+    fs->truncate(fd, 7000);
+    file.resize(7000);
+    fs->truncate(fd, 9000);
+    file.resize(9000, '\0');
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "h 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "h " << handle_is(fs, fd, file) << std::endl;
+    std::cout << "rm(h) of an open file..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Error: rm failed, error code -1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = fs->rm("h");
+    if (ret_val)
+        std::cout << "Error: rm failed, error code " << ret_val << std::endl;
+    fs->close(fd);
+    PRINTDIV2;
+
+    std::cout << "Testing handles after remount..." << std::endl;
+    delete fs;
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    fd = fs->open("h", READ);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "h 1" << std::endl;
+    std::cout << "pwrite -1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "h " << handle_is(fs, fd, file) << std::endl;
+    // the handle is read only
+    std::cout << "pwrite " << fs->pwrite(fd, "x", 1, 0) << std::endl;
+    fs->close(fd);
+    delete fs;
+    PRINTDIV2;
+
+    std::remove(TEST_DISK);
+    std::cout << "... Task 8 done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disk, the tests unmount and mount it again
+#define TEST_DISK "test9.bin"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// <lines> lines of 63 characters, 64 lines fill a block
+static std::string
+file_data(char c, int lines)
+{
+    std::string data;
+    for (int i = 0; i < lines; i++) {
+        data += std::string(63, c + i % 10) + "\n";
+    }
+    return data;
+}
+
+// creates <path> holding <data>, which ends with a newline
+static int
+create_file(FS* fs, const std::string& path, const std::string& data)
+{
+    std::istringstream in(data + "\n");
+    return fs->create(path, in);
+}
+
+// tells if the file <path> holds <data>
+static bool
+file_is(FS* fs, const std::string& path, const std::string& data)
+{
+    std::ostringstream out;
+    return fs->cat(path, out) == 0 && out.str() == data;
+}
+
+// the size of the disk file in blocks
+static long
+disk_blocks()
+{
+    struct stat st;
+    if (stat(TEST_DISK, &st) != 0)
+        return -1;
+    return st.st_size / BLOCK_SIZE;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    FS* fs;
+    std::string a = file_data('a', 200); // 4 blocks
+    std::string b = file_data('b', 30);
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 9 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing the memory mapped disk..." << std::endl;
+    std::cout << "Use " << TEST_DISK << " as test disk..." << std::endl;
+    std::remove(TEST_DISK);
+    fs = new FS(DISK_MODE_MMAP, TEST_DISK);
+    fs->format();
+    create_file(fs, "a", a);
+    fs->mkdir("d");
+    create_file(fs, "d/b", b);
+    create_file(fs, "x", b);
+    fs->rm("x");
+    delete fs;
+    fs = new FS(DISK_MODE_MMAP, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "a\t file\t rw-\t 12800" << std::endl;
+    std::cout << "d\t dir\t rwx\t -" << std::endl;
+    std::cout << "a 1, d/b 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    fs->ls();
+    std::cout << "a " << file_is(fs, "a", a) << ", d/b " << file_is(fs, "d/b", b) << std::endl;
+    delete fs;
+    // the same image in file mode
+    fs = new FS(DISK_MODE_FILE, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "file mode: a 1, d/b 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "file mode: a " << file_is(fs, "a", a) << ", d/b " << file_is(fs, "d/b", b) << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::cout << "Testing a short disk image..." << std::endl;
+    // a mapping past the end of the file faults, the disk extends it first
+    std::remove(TEST_DISK);
+    int fd = open(TEST_DISK, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0 || write(fd, "short", 5) != 5)
+        std::cout << "Error: can't write " << TEST_DISK << std::endl;
+    close(fd);
+    fs = new FS(DISK_MODE_MMAP, TEST_DISK);
+    fs->format();
+    create_file(fs, "a", a);
+    delete fs;
+    fs = new FS(DISK_MODE_MMAP, TEST_DISK);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "2048 blocks, a 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = disk_blocks();
+    std::cout << ret_val << " blocks, a " << file_is(fs, "a", a) << std::endl;
+    delete fs;
+    PRINTDIV2;
+
+    std::remove(TEST_DISK);
+    std::cout << "... Task 9 done" << std::endl;
+    PRINTDIV;
+}